@@ -1,7 +1,47 @@
 #include <iostream>
 #include <vector>
-#include <unordered_map>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define ZNCC_SIMD_LANES 8
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#define ZNCC_SIMD_LANES 4
+#else
+#define ZNCC_SIMD_LANES 1 // scalar fallback
+#endif
+#if defined(__F16C__) && !defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(__POPCNT__)
+#include <nmmintrin.h>
+#endif
+
+#ifdef USE_OPENCL
+#define CL_TARGET_OPENCL_VERSION 120
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 #include "lodepng.h"
 
@@ -15,40 +55,209 @@
 
 /* 
 	TODO: 
-	- replace in-code blockradius with BLOCK_RADIUS
 	- preprocessor macros for encoding images of intermediate steps
 	- benchmark the using QueryPerformanceCounter()
 */
 
-#define BLOCK_SIZE 15 // Has to be uneven i.e. 9, 15, 25
-#define BLOCK_RADIUS (BLOCK_SIZE - 1) / 2
+#define BLOCK_SIZE 15 // Default window size, has to be uneven i.e. 9, 15, 25
+#define MAX_BLOCK_SIZE 25
 
 #define BYTES_PER_PIXEL 4 // 3 = RGB (24-bit), 4 = RGBA (32-bit)
 
-#define INPUT_IMG_WIDTH 2940
-#define INPUT_IMG_HEIGHT 2016
+#define DOWNSAMPLE_FACTOR 4 // Default: every 4th pixel of every 4th row is matched
+
+#define STRIP_HEIGHT 128 // Default rows per strip of --full-res, the halo rows come on top
 
-#define REDUCED_IMG_WIDTH 735
-#define REDUCED_IMG_HEIGHT 504
+#define MAX_DISP 260 // Default disparity range at input resolution
 
-#define MAX_DISP 260
+#define SUBPIXEL_BITS 4 // fractional bits of the 16-bit sub-pixel disparity map
+
+#define OPENCL_KERNEL_FILE "depthmap_kernels.cl" // default kernel source of --engine=opencl
 
 using std::vector;
-using std::unordered_map;
 
-struct GreyscaleImage {
+enum ZnccEngine {
+	ZNCC_DIRECT,	// window sums recomputed for every pixel and disparity
+	ZNCC_INTEGRAL,	// window sums read from summed-area tables in O(1)
+	ZNCC_SIMD,		// direct engine vectorized across disparities (AVX2/SSE4.1 builds)
+	ZNCC_DESCRIPTOR,	// precomputed window mean / inverse deviation, one dot product per candidate
+	CENSUS_HAMMING,		// census signatures compared with XOR + popcount, for fast previews
+	ZNCC_INTEGER,		// summed-area tables compared exactly in integers, no division or sqrt
+	ZNCC_OPENCL			// whole pipeline as OpenCL kernels (builds with USE_OPENCL)
+};
 
-	unsigned width, height;
-	vector<unsigned char> pixels;
+enum CostStorage {
+	COST_FP16,	// IEEE half precision
+	COST_INT16	// score * 32767 rounded, -32768 marks a missing score
+};
+
+enum CostLayout {
+	COST_PIXEL_MAJOR,		// [y][x][d], candidates of one pixel are contiguous
+	COST_DISPARITY_MAJOR	// [d][y][x], one image-sized plane per disparity
+};
+
+enum DownscaleFilter {
+	DOWNSCALE_POINT,	// every factor-th pixel of every factor-th row, integer factors only
+	DOWNSCALE_AREA		// average over the area each output pixel covers, any factor >= 1
+};
+
+struct Settings {
+	const char *left_filename = "im0.png";
+	const char *right_filename = "im1.png";
+	ZnccEngine engine = ZNCC_DIRECT;
+	unsigned num_threads = std::thread::hardware_concurrency();
+	int block_size = BLOCK_SIZE;
+	int max_disp = MAX_DISP;
+	bool shared_cost_volume = false;	// descriptor engine: score L2R and R2L from one cost volume
+	bool store_cost_volume = false;		// descriptor engine: keep the whole 16-bit cost volume
+	CostStorage cost_storage = COST_FP16;
+	CostLayout cost_layout = COST_PIXEL_MAJOR;
+	int pyramid_levels = 0;				// descriptor engine: coarse-to-fine search over this many halvings
+	int pyramid_band = 4;				// per-level search radius around the coarse disparity
+	bool subpixel = false;				// descriptor engine: also write a 16-bit sub-pixel L2R map
+	int sgm_paths = 0;					// descriptor engine: semi-global matching over 4 or 8 paths
+	int sgm_p1 = 24;
+	int sgm_p2 = 256;
+	bool prune = false;					// descriptor engine: skip candidates whose score bound cannot win
+	bool max_disp_given = false;		// --max-disp was on the command line, it then overrides the calibrated vmax
+	const char *calib_filename = nullptr;	// Middlebury calib.txt whose vmin/vmax bound the search
+	int tile_width = 0;					// direct, simd and descriptor engines: cache-blocked tiles, 0 = full rows
+	int tile_height = 0;
+	bool benchmark_tiles = false;		// time the search over a set of tile sizes and exit
+	const char *opencl_kernel_filename = OPENCL_KERNEL_FILE;
+	double downsample = DOWNSAMPLE_FACTOR;
+	DownscaleFilter downscale_filter = DOWNSCALE_POINT;
+	int strip_height = 0;				// match the image in strips of this many rows, 0 = all at once
+	bool self_test = false;				// compare the engines on a synthetic pair instead of matching
+};
+
+/*
+	Allocator for planes that SIMD loops read row by row: storage starts on a
+	64-byte cache line boundary. The pointer returned by operator new is kept
+	just in front of the aligned block so deallocate can hand it back.
+*/
+#define PLANE_ALIGNMENT 64
+
+template <typename T>
+struct AlignedAllocator {
+	typedef T value_type;
+
+	AlignedAllocator() {}
+	template <typename U> AlignedAllocator(const AlignedAllocator<U> &) {}
+
+	T *allocate(size_t n) {
+		char *raw = (char *)::operator new(n * sizeof(T) + PLANE_ALIGNMENT);
+		char *aligned = (char *)(((uintptr_t)raw + PLANE_ALIGNMENT) & ~(uintptr_t)(PLANE_ALIGNMENT - 1));
+		((char **)aligned)[-1] = raw;
+		return (T *)aligned;
+	}
+	void deallocate(T *p, size_t) {
+		::operator delete(((char **)p)[-1]);
+	}
+};
+
+template <typename T, typename U>
+bool operator==(const AlignedAllocator<T> &, const AlignedAllocator<U> &) { return true; }
+template <typename T, typename U>
+bool operator!=(const AlignedAllocator<T> &, const AlignedAllocator<U> &) { return false; }
+
+typedef vector<float, AlignedAllocator<float> > FloatPlane;
+
+/*
+	Non-owning view of a strided image: row y starts at data + y * stride elements and
+	holds width * Channels of them. Sub-views share the pixels of their parent, so a
+	tile or strip costs no copy.
+*/
+template <typename T, int Channels = 1>
+struct ImageView {
+	T *data;
+	unsigned width, height, stride;
+
+	T *row(unsigned y) const { return data + (size_t)y * stride; }
+	ImageView view(unsigned x, unsigned y, unsigned view_width, unsigned view_height) const {
+		ImageView roi = { row(y) + x * Channels, view_width, view_height, stride };
+		return roi;
+	}
+};
+
+/*
+	Image that owns its pixels. Storage starts on a PLANE_ALIGNMENT boundary and every
+	row is padded to a multiple of PLANE_ALIGNMENT bytes, so each row starts aligned and
+	SIMD loops may read up to the end of the padding.
+*/
+template <typename T, int Channels = 1>
+struct Image {
+	unsigned width, height, stride;
+	vector<T, AlignedAllocator<T> > pixels;
+
+	Image() : width(0), height(0), stride(0) {}
+	Image(unsigned image_width, unsigned image_height) : width(0), height(0), stride(0) { resize(image_width, image_height); }
+
+	// Keeps the storage when it is already large enough
+	void resize(unsigned image_width, unsigned image_height) {
+		size_t row_bytes = (size_t)image_width * Channels * sizeof(T);
+		size_t padded_bytes = (row_bytes + PLANE_ALIGNMENT - 1) / PLANE_ALIGNMENT * PLANE_ALIGNMENT;
+		width = image_width;
+		height = image_height;
+		stride = (unsigned)(padded_bytes / sizeof(T));
+		pixels.resize((size_t)stride * height);
+	}
+
+	// resize, then set every element, padding included, to value
+	void assign(unsigned image_width, unsigned image_height, const T &value) {
+		resize(image_width, image_height);
+		std::fill(pixels.begin(), pixels.end(), value);
+	}
+
+	T *row(unsigned y) { return pixels.data() + (size_t)y * stride; }
+	const T *row(unsigned y) const { return pixels.data() + (size_t)y * stride; }
 
-	unsigned char get_pixel(unsigned x, unsigned y) {
+	// First channel at (x, y), 0 outside the image
+	T get_pixel(unsigned x, unsigned y) const {
 		if (x >= width || y >= height) {
 			return 0;
 		}
-		return pixels[y*width + x];
+		return row(y)[x * Channels];
+	}
+
+	ImageView<T, Channels> view() {
+		ImageView<T, Channels> all = { pixels.data(), width, height, stride };
+		return all;
+	}
+	ImageView<const T, Channels> view() const {
+		ImageView<const T, Channels> all = { pixels.data(), width, height, stride };
+		return all;
+	}
+	ImageView<T, Channels> view(unsigned x, unsigned y, unsigned view_width, unsigned view_height) {
+		return view().view(x, y, view_width, view_height);
+	}
+	ImageView<const T, Channels> view(unsigned x, unsigned y, unsigned view_width, unsigned view_height) const {
+		return view().view(x, y, view_width, view_height);
 	}
 };
 
+typedef Image<unsigned char> GreyscaleImage;
+
+// Copies the pixels of source into destination, which must have the same size
+template <typename S, typename T, int Channels>
+void copy_pixels(const ImageView<S, Channels> &source, const ImageView<T, Channels> &destination) {
+	for (unsigned y = 0; y < source.height; y++) {
+		std::copy(source.row(y), source.row(y) + source.width * Channels, destination.row(y));
+	}
+}
+
+// One byte per pixel: disparities and their cross-checked, filled and normalised forms
+typedef Image<unsigned char> DisparityMap;
+typedef ImageView<unsigned char> DisparityView;
+
+// Decoded input images, BYTES_PER_PIXEL channels, borrowed from lodepng's buffers
+typedef ImageView<const unsigned char, BYTES_PER_PIXEL> RgbaView;
+
+inline RgbaView rgba_view(const vector<unsigned char> &pixels, unsigned width, unsigned height) {
+	RgbaView view = { pixels.data(), width, height, width * BYTES_PER_PIXEL };
+	return view;
+}
+
 void decodeFile(const char* filename, vector<uint8_t> &image, unsigned &width, unsigned &height) {
 
 	//decode
@@ -68,101 +277,658 @@ void encode_to_greyscale_file(const char* filename, vector<unsigned char> &image
 	if (error) printf("error %u: %s\n", error, lodepng_error_text(error));
 }
 
-void reduce_img_size(vector<unsigned char> &source_img, unsigned source_height, unsigned source_width, vector<unsigned char> &resized_img) {
-	// put every 4th pixel from source_img[] to resized_img[]
-	for (unsigned int y = 0; y < source_height; y += 4) {
-		for (unsigned int x = 0; x < source_width; x += 4) {
-			unsigned char r = source_img[BYTES_PER_PIXEL*(y*source_width + x)];
-			unsigned char g = source_img[BYTES_PER_PIXEL*(y*source_width + x) + 1];
-			unsigned char b = source_img[BYTES_PER_PIXEL*(y*source_width + x) + 2];
-			unsigned char a = source_img[BYTES_PER_PIXEL*(y*source_width + x) + 3];
-			resized_img.push_back(r);
-			resized_img.push_back(g);
-			resized_img.push_back(b);
-			resized_img.push_back(a);
+// Drops the row padding, lodepng expects packed rows
+void encode_to_greyscale_file(const char* filename, const GreyscaleImage &image) {
+	vector<unsigned char> packed(image.width * image.height);
+	for (unsigned y = 0; y < image.height; y++) {
+		std::copy(image.row(y), image.row(y) + image.width, &packed[y * image.width]);
+	}
+	encode_to_greyscale_file(filename, packed, image.width, image.height);
+}
+
+// 16-bit greyscale PNG, samples are written big-endian as PNG requires
+void encode_to_greyscale_16_file(const char* filename, const Image<uint16_t> &image) {
+	vector<unsigned char> bytes(2 * image.width * image.height);
+	size_t i = 0;
+	for (unsigned y = 0; y < image.height; y++) {
+		for (unsigned x = 0; x < image.width; x++, i++) {
+			bytes[2 * i] = image.row(y)[x] >> 8;
+			bytes[2 * i + 1] = image.row(y)[x] & 0xff;
 		}
 	}
+	unsigned error = lodepng::encode(filename, bytes, image.width, image.height, LCT_GREY, 16);
+	if (error) printf("error %u: %s\n", error, lodepng_error_text(error));
+}
+
+/*
+	Fixed-point greyscale: grey = (GREY_RED * r + GREY_GREEN * g + GREY_BLUE * b + GREY_ROUNDING) >> 15.
+	The coefficients are 0.2126, 0.7152 and 0.0722 scaled by 2^15 and sum to exactly 2^15,
+	so white stays 255 and nothing can overflow a byte. They fit the signed 16-bit operands
+	of pmaddwd. The rounding term is the one of 0..16 closest to the float conversion
+	(0.2126f * r + 0.7152f * g + 0.0722f * b, rounded down): of all 2^24 RGB colours,
+	18476 (0.11%) come out one grey level lower or higher than with floats, none by more
+	than one. 7 does as well; 8 gives 18527 and 0 gives 18589. --self-test recounts them.
+*/
+#define GREY_RED 6966
+#define GREY_GREEN 23436
+#define GREY_BLUE 2366
+#define GREY_ROUNDING 6
+
+// Greyscale value of an RGBA pixel times 2^15, before rounding
+inline unsigned grey_sum(const unsigned char *pixel) {
+	return GREY_RED * pixel[0] + GREY_GREEN * pixel[1] + GREY_BLUE * pixel[2];
 }
 
-void convert_to_greyscale(vector<unsigned char> &input_img, GreyscaleImage &output_img) {
-	for (unsigned byte = 0; byte < input_img.size(); byte += 4) {
-		unsigned char r = input_img[byte];
-		unsigned char g = input_img[byte + 1];
-		unsigned char b = input_img[byte + 2];
-		// rounds down
-		unsigned char greyscale_value = 0.2126f * r + 0.7152f * g + 0.0722f * b;
-		output_img.pixels.push_back(greyscale_value);
+inline unsigned char greyscale_value(const unsigned char *pixel) {
+	return (grey_sum(pixel) + GREY_ROUNDING) >> 15;
+}
+
+/*
+	grey_sum of the RGBA pixels in the 32-bit lanes of pixels: a byte shuffle spreads each
+	pixel into 16-bit (r, g) pairs and b values and pmaddwd applies the coefficients.
+*/
+#if ZNCC_SIMD_LANES == 8
+inline __m256i grey_sums(__m256i pixels) {
+	const __m256i red_green = _mm256_setr_epi8(0, -1, 1, -1, 4, -1, 5, -1, 8, -1, 9, -1, 12, -1, 13, -1,
+											   0, -1, 1, -1, 4, -1, 5, -1, 8, -1, 9, -1, 12, -1, 13, -1);
+	const __m256i blue = _mm256_setr_epi8(2, -1, -1, -1, 6, -1, -1, -1, 10, -1, -1, -1, 14, -1, -1, -1,
+										  2, -1, -1, -1, 6, -1, -1, -1, 10, -1, -1, -1, 14, -1, -1, -1);
+	const __m256i red_green_weights = _mm256_set1_epi32(GREY_GREEN << 16 | GREY_RED);
+	const __m256i blue_weight = _mm256_set1_epi32(GREY_BLUE);
+	return _mm256_add_epi32(_mm256_madd_epi16(_mm256_shuffle_epi8(pixels, red_green), red_green_weights),
+							_mm256_madd_epi16(_mm256_shuffle_epi8(pixels, blue), blue_weight));
+}
+#elif ZNCC_SIMD_LANES == 4
+inline __m128i grey_sums(__m128i pixels) {
+	const __m128i red_green = _mm_setr_epi8(0, -1, 1, -1, 4, -1, 5, -1, 8, -1, 9, -1, 12, -1, 13, -1);
+	const __m128i blue = _mm_setr_epi8(2, -1, -1, -1, 6, -1, -1, -1, 10, -1, -1, -1, 14, -1, -1, -1);
+	const __m128i red_green_weights = _mm_set1_epi32(GREY_GREEN << 16 | GREY_RED);
+	const __m128i blue_weight = _mm_set1_epi32(GREY_BLUE);
+	return _mm_add_epi32(_mm_madd_epi16(_mm_shuffle_epi8(pixels, red_green), red_green_weights),
+						 _mm_madd_epi16(_mm_shuffle_epi8(pixels, blue), blue_weight));
+}
+#endif
+
+/*
+	One row of the greyscale image reduced by factor: every factor-th RGBA pixel of
+	source_row is converted straight to its greyscale value, so decoding is followed by a
+	single pass over the input with no intermediate RGBA or greyscale copies. The SIMD
+	versions load ZNCC_SIMD_LANES pixels into 32-bit lanes and convert them with grey_sums.
+*/
+void downscale_greyscale_row(const unsigned char *source_row, unsigned factor, unsigned width, unsigned char *output_row) {
+	unsigned x = 0;
+#if ZNCC_SIMD_LANES == 8
+	const __m256i rounding = _mm256_set1_epi32(GREY_ROUNDING);
+	const __m256i first_dwords = _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0);
+	for (; x + 8 <= width; x += 8) {
+		const unsigned char *first_pixel = source_row + BYTES_PER_PIXEL * x * factor;
+		__m256i pixels;
+		if (factor == 1) {
+			pixels = _mm256_loadu_si256((const __m256i *)first_pixel);
+		}
+		else {
+			// Scalar loads beat vpgatherdd here
+			int packed[8];
+			for (int i = 0; i < 8; i++) {
+				memcpy(&packed[i], first_pixel + i * BYTES_PER_PIXEL * factor, sizeof(int));
+			}
+			pixels = _mm256_loadu_si256((const __m256i *)packed);
+		}
+		__m256i grey = _mm256_srli_epi32(_mm256_add_epi32(grey_sums(pixels), rounding), 15);
+		// Bytes 0-3 of each 128-bit lane hold the 4 values of that lane
+		grey = _mm256_packus_epi16(_mm256_packus_epi32(grey, grey), grey);
+		grey = _mm256_permutevar8x32_epi32(grey, first_dwords);
+		_mm_storel_epi64((__m128i *)(output_row + x), _mm256_castsi256_si128(grey));
+	}
+#elif ZNCC_SIMD_LANES == 4
+	const __m128i rounding = _mm_set1_epi32(GREY_ROUNDING);
+	for (; x + 4 <= width; x += 4) {
+		const unsigned char *first_pixel = source_row + BYTES_PER_PIXEL * x * factor;
+		__m128i pixels;
+		if (factor == 1) {
+			pixels = _mm_loadu_si128((const __m128i *)first_pixel);
+		}
+		else {
+			int packed[4];
+			for (int i = 0; i < 4; i++) {
+				memcpy(&packed[i], first_pixel + i * BYTES_PER_PIXEL * factor, sizeof(int));
+			}
+			pixels = _mm_loadu_si128((const __m128i *)packed);
+		}
+		__m128i grey = _mm_srli_epi32(_mm_add_epi32(grey_sums(pixels), rounding), 15);
+		grey = _mm_packus_epi16(_mm_packus_epi32(grey, grey), grey);
+		int values = _mm_cvtsi128_si32(grey);
+		memcpy(output_row + x, &values, sizeof(values));
+	}
+#endif
+	for (; x < width; x++) {
+		output_row[x] = greyscale_value(source_row + BYTES_PER_PIXEL * x * factor);
 	}
 }
 
-vector<unsigned char> get_window_around_point(GreyscaleImage &image, unsigned center_x, unsigned center_y, int block_radius) {
+/*
+	Area-averaging weights of one axis. Output pixel i covers the source interval
+	[i * factor, (i + 1) * factor) and every source pixel under it is weighted by its overlap
+	with that interval, divided by factor. Each output pixel has taps weights starting at
+	source pixel first[i], padded with zeros, so integer factors get factor equal weights
+	and fractional factors split the border pixels between neighbours.
+*/
+struct AreaWeights {
+	unsigned taps;
+	vector<unsigned> first;
+	vector<float> weights;
+};
+
+// Weights of the num_outputs output pixels from first_output on, table keeps its storage between calls
+void calc_area_weights(double factor, unsigned first_output, unsigned num_outputs, AreaWeights &table) {
+	table.taps = (unsigned)ceil(factor) + 1;
+	table.first.resize(num_outputs);
+	table.weights.assign(num_outputs * table.taps, 0.0f);
+	for (unsigned i = 0; i < num_outputs; i++) {
+		double begin = (first_output + i) * factor;
+		double end = (first_output + i + 1) * factor;
+		unsigned first = (unsigned)floor(begin);
+		table.first[i] = first;
+		// Overlaps below 1e-9 are rounding noise of factor and would read past the image
+		for (unsigned tap = 0; tap < table.taps && first + tap < end - 1e-9; tap++) {
+			double overlap = std::min(end, first + tap + 1.0) - std::max(begin, first + tap + 0.0);
+			table.weights[i * table.taps + tap] = (float)(overlap / factor);
+		}
+	}
+}
 
-	vector<unsigned char> window_pixels;
+/*
+	sums[x] += weight * greyscale value of the RGBA pixel source_row[x], for width pixels.
+	The value is grey_sum / 2^15 with the fixed-point coefficients of the point filter, left
+	unrounded so that only the averaged output pixel is rounded. grey_sum stays below 2^24,
+	so its float conversion is exact.
+*/
+inline void accumulate_greyscale_row(const unsigned char *source_row, unsigned width, float weight, float *sums) {
+	unsigned x = 0;
+	float scaled_weight = weight / (1 << 15);
+#if ZNCC_SIMD_LANES == 8
+	const __m256 row_weight = _mm256_set1_ps(scaled_weight);
+	for (; x + 8 <= width; x += 8) {
+		__m256i pixels = _mm256_loadu_si256((const __m256i *)(source_row + BYTES_PER_PIXEL * x));
+		__m256 grey = _mm256_cvtepi32_ps(grey_sums(pixels));
+		_mm256_storeu_ps(sums + x, _mm256_add_ps(_mm256_loadu_ps(sums + x), _mm256_mul_ps(row_weight, grey)));
+	}
+#elif ZNCC_SIMD_LANES == 4
+	const __m128 row_weight = _mm_set1_ps(scaled_weight);
+	for (; x + 4 <= width; x += 4) {
+		__m128i pixels = _mm_loadu_si128((const __m128i *)(source_row + BYTES_PER_PIXEL * x));
+		__m128 grey = _mm_cvtepi32_ps(grey_sums(pixels));
+		_mm_storeu_ps(sums + x, _mm_add_ps(_mm_loadu_ps(sums + x), _mm_mul_ps(row_weight, grey)));
+	}
+#endif
+	for (; x < width; x++) {
+		sums[x] += scaled_weight * (float)grey_sum(source_row + BYTES_PER_PIXEL * x);
+	}
+}
 
-	for (unsigned y = center_y - block_radius; y <= center_y + block_radius; y++) {
-		for (unsigned x = center_x - block_radius; x <= center_x + block_radius; x++) {
-			window_pixels.push_back(image.get_pixel(x, y));
+/*
+	Output row row of the area-averaged greyscale image. The source rows under it are
+	accumulated into row_sums with their row weights (the vectorized part, every source
+	pixel is touched once per row it belongs to), then each output pixel sums its taps of
+	row_sums with the column weights. row_sums holds source.width + column_weights.taps
+	floats whose tail stays zero. Values round to nearest.
+*/
+void area_downscale_greyscale_row(const RgbaView &source, const AreaWeights &row_weights, unsigned row,
+								  const AreaWeights &column_weights, unsigned width, float *row_sums, unsigned char *output_row) {
+	std::fill(row_sums, row_sums + source.width, 0.0f);
+	for (unsigned tap = 0; tap < row_weights.taps; tap++) {
+		float weight = row_weights.weights[row * row_weights.taps + tap];
+		if (weight > 0) {
+			accumulate_greyscale_row(source.row(row_weights.first[row] + tap), source.width, weight, row_sums);
 		}
 	}
-	return window_pixels;
+	for (unsigned x = 0; x < width; x++) {
+		const float *sums = row_sums + column_weights.first[x];
+		const float *weights = &column_weights.weights[x * column_weights.taps];
+		float value = 0.5f;
+		for (unsigned tap = 0; tap < column_weights.taps; tap++) {
+			value += weights[tap] * sums[tap];
+		}
+		output_row[x] = value < 255.0f ? (unsigned char)value : 255;
+	}
 }
 
-unordered_map<unsigned, float> calc_window_averages(GreyscaleImage &image, int block_radius) {
+/*
+	Non-owning view of the window centered at (center_x, center_y): a pointer to the
+	window's top-left pixel, the image stride and the radius. Row wy of the window
+	(0 <= wy <= 2 * radius) starts at row(wy). Nothing is copied or allocated, so the
+	image must outlive the view and the whole window must lie inside the image.
+*/
+struct WindowView {
+	const unsigned char *top_left;
+	unsigned stride;
+	int radius;
+
+	const unsigned char *row(int wy) const { return top_left + wy*stride; }
+};
 
-	unsigned pixel_index;
-	unordered_map<unsigned, float> avg_map;
-	for (int y = 0; y < (int)image.height; y++) {
-		if (y - block_radius < 0 || y + block_radius >= (int)image.height) {
-			continue;
+inline WindowView get_window_view(const unsigned char *pixels, unsigned stride, int center_x, int center_y, int block_radius) {
+	WindowView window = { pixels + (center_y - block_radius)*stride + center_x - block_radius, stride, block_radius };
+	return window;
+}
+
+inline WindowView get_window_view(const GreyscaleImage &image, int center_x, int center_y, int block_radius) {
+	return get_window_view(image.row(0), image.stride, center_x, center_y, block_radius);
+}
+
+/*
+	Worker threads shared by all the band runners below. Threads are started the first
+	time a job needs them and then wait for the next job, so a runner call starts no
+	threads and allocates nothing. run(num_workers, job, context) calls job(context, i)
+	once on each worker i < num_workers and returns when all of them are done; jobs must
+	not start runners themselves. stop joins the threads, the next job starts them again.
+*/
+struct WorkerPool {
+	vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable job_ready, job_done;
+	void (*job)(void *, unsigned) = nullptr;
+	void *context = nullptr;
+	unsigned num_workers = 0;
+	unsigned generation = 0;	// counts the jobs, a worker runs every generation once
+	unsigned pending = 0;		// workers of the current job still running
+	bool stopping = false;
+
+	~WorkerPool() { stop(); }
+
+	void run(unsigned job_workers, void (*job_function)(void *, unsigned), void *job_context) {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (threads.size() < job_workers) {
+			threads.push_back(std::thread(&WorkerPool::work, this, (unsigned)threads.size(), generation));
+		}
+		job = job_function;
+		context = job_context;
+		num_workers = job_workers;
+		pending = job_workers;
+		generation++;
+		job_ready.notify_all();
+		job_done.wait(lock, [&]() { return pending == 0; });
+	}
+
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
 		}
-		for (int x = 0; x < (int)image.width; x++) {
-			if (x - block_radius < 0 || x + block_radius >= (int)image.width) {
+		job_ready.notify_all();
+		for (unsigned i = 0; i < threads.size(); i++) {
+			threads[i].join();
+		}
+		threads.clear();
+		stopping = false;
+	}
+
+	void work(unsigned index, unsigned seen_generation) {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			job_ready.wait(lock, [&]() { return stopping || generation != seen_generation; });
+			if (stopping) {
+				return;
+			}
+			seen_generation = generation;
+			if (index >= num_workers) {
 				continue;
 			}
+			void (*job_function)(void *, unsigned) = job;
+			void *job_context = context;
+			lock.unlock();
+			job_function(job_context, index);
+			lock.lock();
+			if (--pending == 0) {
+				job_done.notify_one();
+			}
+		}
+	}
+};
 
-			vector<unsigned char> window_pixels = get_window_around_point(image, x, y, block_radius);
+WorkerPool worker_pool;
 
-			unsigned sum = 0;
-			for (unsigned i = 0; i < window_pixels.size(); i++) {
-				sum += window_pixels[i];
+// Runs process(worker) on num_workers pool threads
+template <typename WorkerFunction>
+void run_on_workers(unsigned num_workers, WorkerFunction &process) {
+	struct Job {
+		static void run(void *context, unsigned worker) { (*(WorkerFunction *)context)(worker); }
+	};
+	worker_pool.run(num_workers, &Job::run, &process);
+}
+
+/*
+	Splits rows [0, height) into bands and hands them out to num_threads workers.
+	Bands are a few times smaller than height / num_threads so that threads which
+	get cheap border rows pick up more work. process_band(worker, y_begin, y_end) must
+	only write rows of its own band; worker is the index of the thread running it, below
+	max(num_threads, 1), so stages can hand each thread its own slice of preallocated scratch.
+*/
+template <typename BandFunction>
+void run_worker_row_bands(int height, unsigned num_threads, BandFunction process_band) {
+	if (num_threads <= 1 || height <= 1) {
+		process_band(0u, 0, height);
+		return;
+	}
+	int num_bands = 4 * num_threads;
+	int rows_per_band = (height + num_bands - 1) / num_bands;
+	std::atomic<int> next_band(0);
+
+	auto process_bands = [&](unsigned worker) {
+		for (int band = next_band++; band * rows_per_band < height; band = next_band++) {
+			int y_begin = band * rows_per_band;
+			int y_end = y_begin + rows_per_band < height ? y_begin + rows_per_band : height;
+			process_band(worker, y_begin, y_end);
+		}
+	};
+	run_on_workers(num_threads, process_bands);
+}
+
+// Rows of the largest band run_contiguous_row_bands hands out, to size per-thread scratch
+inline int contiguous_band_rows(int height, unsigned num_threads) {
+	return num_threads <= 1 ? height : (height + num_threads - 1) / num_threads;
+}
+
+/*
+	Like run_worker_row_bands, but worker i gets the single band i of num_threads contiguous
+	bands. For stages whose setup per band costs halo rows, such as the cross-sum tables of
+	the integral and integer engines, so the redundant rows stay at one halo per thread.
+*/
+template <typename BandFunction>
+void run_contiguous_row_bands(int height, unsigned num_threads, BandFunction process_band) {
+	if (num_threads <= 1 || height <= 1) {
+		process_band(0u, 0, height);
+		return;
+	}
+	int rows_per_band = contiguous_band_rows(height, num_threads);
+
+	auto process_own_band = [&](unsigned worker) {
+		int y_begin = worker * rows_per_band;
+		int y_end = y_begin + rows_per_band < height ? y_begin + rows_per_band : height;
+		if (y_begin < y_end) {
+			process_band(worker, y_begin, y_end);
+		}
+	};
+	run_on_workers(num_threads, process_own_band);
+}
+
+// run_worker_row_bands for stages that need no per-thread scratch, process_band(y_begin, y_end)
+template <typename BandFunction>
+void run_row_bands(int height, unsigned num_threads, BandFunction process_band) {
+	run_worker_row_bands(height, num_threads, [&](unsigned, int y_begin, int y_end) {
+		process_band(y_begin, y_end);
+	});
+}
+
+/*
+	Cache-blocked variant of run_row_bands: the output map is cut into tile_width x tile_height
+	tiles that are handed out in row-major order, and process_tile(tile, x_begin, y_begin) fills
+	one of them, where tile is the sub-view of map whose top-left pixel is (x_begin, y_begin).
+	Consecutive rows of a tile reuse the reference rows the previous row loaded while they are
+	still cached. A tile_width of 0 falls back to full-width row bands.
+*/
+template <typename TileFunction>
+void run_tiles(const DisparityView &map, int tile_width, int tile_height, unsigned num_threads, TileFunction process_tile) {
+	int width = map.width, height = map.height;
+	if (tile_width <= 0 || tile_height <= 0) {
+		run_row_bands(height, num_threads, [&](int y_begin, int y_end) {
+			process_tile(map.view(0, y_begin, width, y_end - y_begin), 0, y_begin);
+		});
+		return;
+	}
+	int tiles_per_row = (width + tile_width - 1) / tile_width;
+	int num_tiles = tiles_per_row * ((height + tile_height - 1) / tile_height);
+	std::atomic<int> next_tile(0);
+
+	auto process_tiles = [&](unsigned) {
+		for (int tile = next_tile++; tile < num_tiles; tile = next_tile++) {
+			int x_begin = (tile % tiles_per_row) * tile_width;
+			int y_begin = (tile / tiles_per_row) * tile_height;
+			int x_end = x_begin + tile_width < width ? x_begin + tile_width : width;
+			int y_end = y_begin + tile_height < height ? y_begin + tile_height : height;
+			process_tile(map.view(x_begin, y_begin, x_end - x_begin, y_end - y_begin), x_begin, y_begin);
+		}
+	};
+	if (num_threads <= 1) {
+		process_tiles(0);
+		return;
+	}
+	run_on_workers(num_threads, process_tiles);
+}
+
+// Scratch of preprocess_images: the area filter's weights and one slice of row sums per thread
+struct DownscaleScratch {
+	AreaWeights column_weights, row_weights;
+	vector<float> row_sums;
+};
+
+/*
+	Fused preprocessing of both input images: decoded RGBA straight to the reduced greyscale
+	planes. The output images hold the reduced rows from first_row on, which lets strips
+	convert only the rows they match. The rows of the left and the right image form one
+	band range, so the two images are processed concurrently by the same worker threads.
+	DOWNSCALE_POINT needs an integer factor. scratch keeps its storage between calls.
+*/
+void preprocess_images(const RgbaView &left_img, const RgbaView &right_img, double factor, DownscaleFilter filter,
+					   unsigned first_row, unsigned num_threads, DownscaleScratch &scratch, GreyscaleImage &left, GreyscaleImage &right) {
+	unsigned width = left.width, height = left.height;
+	left.resize(width, height);
+	right.resize(width, height);
+	AreaWeights &column_weights = scratch.column_weights, &row_weights = scratch.row_weights;
+	if (filter == DOWNSCALE_AREA) {
+		calc_area_weights(factor, 0, width, column_weights);
+		calc_area_weights(factor, first_row, height, row_weights);
+	}
+	unsigned step = (unsigned)factor;
+	size_t row_sums_size = filter == DOWNSCALE_AREA ? left_img.width + column_weights.taps : 0;
+	vector<float> &row_sums = scratch.row_sums;
+	row_sums.assign(row_sums_size * std::max(num_threads, 1u), 0.0f);
+	run_worker_row_bands(2 * height, num_threads, [&](unsigned worker, int y_begin, int y_end) {
+		float *band_row_sums = row_sums.data() + worker * row_sums_size;
+		for (int y = y_begin; y < y_end; y++) {
+			bool is_left = y < (int)height;
+			unsigned row = is_left ? y : y - height;
+			const RgbaView &source_img = is_left ? left_img : right_img;
+			GreyscaleImage &output = is_left ? left : right;
+			if (filter == DOWNSCALE_AREA) {
+				area_downscale_greyscale_row(source_img, row_weights, row, column_weights, width, band_row_sums, output.row(row));
+			}
+			else {
+				downscale_greyscale_row(source_img.row((first_row + row) * step), step, width, output.row(row));
+			}
+		}
+	});
+}
+
+/*
+	Bytes of source and reference pixels one tile reads: its source windows plus the reference
+	span that num_disps candidates reach. For full-row traversal (tile_height 1, tile_width the
+	image width) this is what must stay cached until the next row reuses it.
+*/
+inline size_t tile_working_set(int tile_width, int tile_height, int block_radius, int num_disps) {
+	size_t window_rows = tile_height + 2 * block_radius;
+	return window_rows * (tile_width + 2 * block_radius) + window_rows * (tile_width + num_disps - 1 + 2 * block_radius);
+}
+
+/*
+	Window sums of every pixel from a separable running-sum box filter. Each band
+	keeps one running column sum per column, slides it down by adding the row that
+	enters the window and subtracting the row that leaves, and then slides a running
+	sum along the columns. Work per pixel is O(1) whatever the window size.
+	Border pixels that cannot be windowed hold 0. sq_sum is only filled when requested.
+*/
+struct BoxSums {
+	Image<uint32_t> sum;
+	Image<uint32_t> sq_sum;
+	vector<uint32_t> column_sums;	// running column sums (and squares), one slice per thread, kept for reuse
+};
+
+// column_sums[x] += enter_row[x] - leave_row[x], and the same for the squares when column_sq_sums is set
+inline void slide_column_sums(uint32_t *column_sums, uint32_t *column_sq_sums,
+							  const unsigned char *enter_row, const unsigned char *leave_row, int width)
+{
+	int x = 0;
+#if ZNCC_SIMD_LANES == 8
+	for (; x + 8 <= width; x += 8) {
+		__m256i enter = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(enter_row + x)));
+		__m256i leave = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(leave_row + x)));
+		__m256i sums = _mm256_loadu_si256((const __m256i *)(column_sums + x));
+		_mm256_storeu_si256((__m256i *)(column_sums + x), _mm256_sub_epi32(_mm256_add_epi32(sums, enter), leave));
+		if (column_sq_sums) {
+			__m256i sq_sums = _mm256_loadu_si256((const __m256i *)(column_sq_sums + x));
+			sq_sums = _mm256_sub_epi32(_mm256_add_epi32(sq_sums, _mm256_mullo_epi32(enter, enter)), _mm256_mullo_epi32(leave, leave));
+			_mm256_storeu_si256((__m256i *)(column_sq_sums + x), sq_sums);
+		}
+	}
+#elif ZNCC_SIMD_LANES == 4
+	for (; x + 4 <= width; x += 4) {
+		int enter_packed, leave_packed;
+		memcpy(&enter_packed, enter_row + x, sizeof(enter_packed));
+		memcpy(&leave_packed, leave_row + x, sizeof(leave_packed));
+		__m128i enter = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(enter_packed));
+		__m128i leave = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(leave_packed));
+		__m128i sums = _mm_loadu_si128((const __m128i *)(column_sums + x));
+		_mm_storeu_si128((__m128i *)(column_sums + x), _mm_sub_epi32(_mm_add_epi32(sums, enter), leave));
+		if (column_sq_sums) {
+			__m128i sq_sums = _mm_loadu_si128((const __m128i *)(column_sq_sums + x));
+			sq_sums = _mm_sub_epi32(_mm_add_epi32(sq_sums, _mm_mullo_epi32(enter, enter)), _mm_mullo_epi32(leave, leave));
+			_mm_storeu_si128((__m128i *)(column_sq_sums + x), sq_sums);
+		}
+	}
+#endif
+	for (; x < width; x++) {
+		uint32_t enter = enter_row[x], leave = leave_row[x];
+		column_sums[x] += enter - leave;
+		if (column_sq_sums) {
+			column_sq_sums[x] += enter * enter - leave * leave;
+		}
+	}
+}
+
+// Box sums of the window centers in rows [y_begin, y_end)
+// column_sums holds width sums, followed by width square sums when box.sq_sum is filled
+void calc_box_sum_rows(GreyscaleImage &image, int block_radius, int y_begin, int y_end, BoxSums &box, uint32_t *column_sums) {
+	int width = image.width;
+	int height = image.height;
+	int window_width = 2 * block_radius + 1;
+	bool with_squares = !box.sq_sum.pixels.empty();
+	if (y_begin < block_radius) y_begin = block_radius;
+	if (y_end > height - block_radius) y_end = height - block_radius;
+	if (y_begin >= y_end || width < window_width) {
+		return;
+	}
+
+	// Column sums of the window rows around y_begin
+	uint32_t *column_sq_sums = column_sums + width;
+	std::fill(column_sums, column_sums + (with_squares ? 2 * width : width), 0);
+	for (int wy = y_begin - block_radius; wy <= y_begin + block_radius; wy++) {
+		const unsigned char *row = image.row(wy);
+		for (int x = 0; x < width; x++) {
+			column_sums[x] += row[x];
+			if (with_squares) {
+				column_sq_sums[x] += (uint32_t)row[x] * row[x];
+			}
+		}
+	}
+
+	for (int y = y_begin; y < y_end; y++) {
+		if (y > y_begin) {
+			slide_column_sums(column_sums, with_squares ? column_sq_sums : nullptr,
+							  image.row(y + block_radius), image.row(y - block_radius - 1), width);
+		}
+		uint32_t sum = 0, sq_sum = 0;
+		uint32_t *sum_row = box.sum.row(y);
+		uint32_t *sq_sum_row = with_squares ? box.sq_sum.row(y) : nullptr;
+		for (int x = 0; x < window_width - 1; x++) {
+			sum += column_sums[x];
+			if (with_squares) sq_sum += column_sq_sums[x];
+		}
+		for (int x = block_radius; x + block_radius < width; x++) {
+			sum += column_sums[x + block_radius];
+			sum_row[x] = sum;
+			sum -= column_sums[x - block_radius];
+			if (with_squares) {
+				sq_sum += column_sq_sums[x + block_radius];
+				sq_sum_row[x] = sq_sum;
+				sq_sum -= column_sq_sums[x - block_radius];
 			}
-			float mean = (float)sum / (float)(BLOCK_SIZE * BLOCK_SIZE);
-			pixel_index = y*image.width + x;
-			avg_map.insert({ pixel_index, mean});
 		}
 	}
-	return avg_map;
 }
 
-vector<unsigned char> calc_disparity_map(GreyscaleImage &src_img, unordered_map<unsigned, float> &src_img_window_avgs, 
-										GreyscaleImage &ref_img, unordered_map<unsigned, float> &ref_img_window_avgs, 
-										int min_disp, int max_disp, int block_radius)
+// Fills box, reusing its storage when it is already large enough
+void calc_box_sums(GreyscaleImage &image, int block_radius, bool with_squares, unsigned num_threads, BoxSums &box) {
+	box.sum.assign(image.width, image.height, 0);
+	if (with_squares) {
+		box.sq_sum.assign(image.width, image.height, 0);
+	}
+	else {
+		box.sq_sum.resize(0, 0);
+	}
+	unsigned scratch_size = (with_squares ? 2 : 1) * image.width;
+	box.column_sums.resize(scratch_size * std::max(num_threads, 1u));
+	run_worker_row_bands(image.height, num_threads, [&](unsigned worker, int y_begin, int y_end) {
+		calc_box_sum_rows(image, block_radius, y_begin, y_end, box, &box.column_sums[worker * scratch_size]);
+	});
+}
+
+/*
+	Window mean of every pixel in one plane the size of the image.
+	Pixels that cannot be windowed hold NO_MEAN.
+*/
+#define NO_MEAN (-1.0f)
+
+typedef Image<float> WindowMeans;
+
+// Fills means, with box as scratch space for the window sums; both keep their storage between calls
+void calc_window_averages(GreyscaleImage &image, int block_radius, unsigned num_threads, BoxSums &box, WindowMeans &means) {
+
+	calc_box_sums(image, block_radius, false, num_threads, box);
+	float window_size = (float)((2 * block_radius + 1) * (2 * block_radius + 1));
+	means.assign(image.width, image.height, NO_MEAN);
+	for (int y = block_radius; y + block_radius < (int)image.height; y++) {
+		const uint32_t *sum_row = box.sum.row(y);
+		float *mean_row = means.row(y);
+		for (int x = block_radius; x + block_radius < (int)image.width; x++) {
+			mean_row[x] = (float)sum_row[x] / window_size;
+		}
+	}
+}
+
+/*
+	Disparity search for one tile of the disparity map: tile is the sub-view whose top-left
+	pixel is (x_begin, y_begin). FIXED_RADIUS > 0 compiles the window loops for that radius,
+	like calc_disparity_rows_descriptor.
+*/
+template <int FIXED_RADIUS = 0>
+void calc_disparity_rows(GreyscaleImage &src_img, const WindowMeans &src_img_window_avgs, 
+						 GreyscaleImage &ref_img, const WindowMeans &ref_img_window_avgs, 
+						 int min_disp, int max_disp, int block_radius, int x_begin, int y_begin,
+						 const DisparityView &tile)
 {
+	const int radius = FIXED_RADIUS > 0 ? FIXED_RADIUS : block_radius;
+	int x_end = x_begin + tile.width, y_end = y_begin + tile.height;
 	float zncc_numerator_sum;
 	float zncc_denominator_sum_L;
 	float zncc_denominator_sum_R;
 	float zncc;
 	float best_zncc;
 	unsigned char best_disparity_value;
-	unsigned pixel_index;
-	unsigned ref_img_pixel_index;
-	vector<unsigned char> disparity_map;
 	// For each pixel in source image...
-	for (int y = 0; y < (int)src_img.height; y++) {
-		for (int x = 0; x < (int)src_img.width; x++) {
+	for (int y = y_begin; y < y_end; y++) {
+		unsigned char *tile_row = tile.row(y - y_begin) - x_begin;
+		for (int x = x_begin; x < x_end; x++) {
 			// Only consider pixels that can be windowed
-			if (x - block_radius < 0 || x + block_radius >= (int)src_img.width ||
-				y - block_radius < 0 || y + block_radius >= (int)src_img.height) {
+			if (x - radius < 0 || x + radius >= (int)src_img.width ||
+				y - radius < 0 || y + radius >= (int)src_img.height) {
 				//std::cout << "At column " << x << ", row " << y <<", writing 0 to disparity map." << std::endl;
-				disparity_map.push_back(0);
+				tile_row[x] = 0;
 				continue;
 			}
-			// Get pixel index to get window mean value from map
-			pixel_index = y*src_img.width + x;
 			// Get mean of pixel's window 
-			float src_window_mean = src_img_window_avgs[pixel_index];
-			// Get pixel values of window (length = blocksize**2 = 81)
-			vector<unsigned char> src_window_pixels = get_window_around_point(src_img, x, y, block_radius);
+			float src_window_mean = src_img_window_avgs.row(y)[x];
+			// View of the window's pixels (blocksize**2 of them), nothing is copied
+			WindowView src_window = get_window_view(src_img, x, y, radius);
 			
 			zncc = 0;
 			best_zncc = 0;
@@ -172,26 +938,29 @@ vector<unsigned char> calc_disparity_map(GreyscaleImage &src_img, unordered_map<
 
 				int offset = x - disparity; // offset = value of x in reference image
 
-				if (offset - block_radius < 0 || offset + block_radius >= (int)src_img.width) {
+				if (offset - radius < 0 || offset + radius >= (int)src_img.width) {
 					break; // Make sure that disparity values dont move the window outside of image.
 				}
 
 				zncc_numerator_sum = 0;
 				zncc_denominator_sum_L = 0;
 				zncc_denominator_sum_R = 0;
-				ref_img_pixel_index = y*ref_img.width + offset;
-				float ref_window_mean = ref_img_window_avgs[ref_img_pixel_index];
-				vector<unsigned char> ref_window_pixels = get_window_around_point(ref_img, offset, y, block_radius);
+				float ref_window_mean = ref_img_window_avgs.row(y)[offset];
+				WindowView ref_window = get_window_view(ref_img, offset, y, radius);
 
 				// For pixel in window...
-				for (unsigned i = 0; i < src_window_pixels.size(); i++) {
-					
-					float src_window_diff = src_window_pixels[i] - src_window_mean;
-					float ref_window_diff = ref_window_pixels[i] - ref_window_mean;
+				for (int wy = 0; wy <= 2 * radius; wy++) {
+					const unsigned char *src_row = src_window.row(wy);
+					const unsigned char *ref_row = ref_window.row(wy);
+					for (int wx = 0; wx <= 2 * radius; wx++) {
 
-					zncc_numerator_sum += (src_window_diff * ref_window_diff);
-					zncc_denominator_sum_L += pow(src_window_diff, 2);
-					zncc_denominator_sum_R += pow(ref_window_diff, 2);
+						float src_window_diff = src_row[wx] - src_window_mean;
+						float ref_window_diff = ref_row[wx] - ref_window_mean;
+
+						zncc_numerator_sum += (src_window_diff * ref_window_diff);
+						zncc_denominator_sum_L += pow(src_window_diff, 2);
+						zncc_denominator_sum_R += pow(ref_window_diff, 2);
+					}
 				}
 
 				// Calculate ZNCC, store highest disparity value
@@ -202,136 +971,3035 @@ vector<unsigned char> calc_disparity_map(GreyscaleImage &src_img, unordered_map<
 				}
 			}
 			//std::cout << "Disparity for (" << x << "," << y << ") is " << (int)best_disparity_value << std::endl;
-			disparity_map.push_back(best_disparity_value);
+			tile_row[x] = best_disparity_value;
 		}
 	}
-	return disparity_map;
 }
 
-GreyscaleImage cross_check(GreyscaleImage &left_image, GreyscaleImage &right_image, int threshold) {
-	/*
-	instead of 
-	abs(Left[index] - Right[index])
-	DO THIS
-	abs(Left[index] - Right[index - Left[index]])
-	*/
+typedef void (*ZnccRowsFunction)(GreyscaleImage &, const WindowMeans &, GreyscaleImage &, const WindowMeans &,
+								 int, int, int, int, int, const DisparityView &);
 
-	GreyscaleImage cross_checked_image;
-	cross_checked_image.height = left_image.height;
-	cross_checked_image.width = left_image.width;
-	cross_checked_image.pixels = left_image.pixels;
-	for (int x = 0; x < (int)left_image.pixels.size(); x++) {
-		if (abs(left_image.pixels[x] - right_image.pixels[x - left_image.pixels[x]]) > threshold) {
-			cross_checked_image.pixels[x] = 0;
-		}
+// Kernel specialized for the common window sizes 5, 7, 9, 15 and 25, generic otherwise
+ZnccRowsFunction select_zncc_rows(int block_radius) {
+	switch (block_radius) {
+	case 2: return calc_disparity_rows<2>;
+	case 3: return calc_disparity_rows<3>;
+	case 4: return calc_disparity_rows<4>;
+	case 7: return calc_disparity_rows<7>;
+	case 12: return calc_disparity_rows<12>;
+	default: return calc_disparity_rows<0>;
 	}
-	return cross_checked_image;
 }
 
-unsigned char get_nearest_nonzero_pixel(GreyscaleImage &image, unsigned target_x, unsigned target_y) {
-	
-	/*
-	[ t o p ] r
-	l # # # # i
-	e # # # # g
-	e # # # # h
-	f # # # # t
-	t [ b o t ] 
-	*/
+// Writes into disparity_map, which keeps its storage if it already has the image size
+void calc_disparity_map(GreyscaleImage &src_img, WindowMeans &src_img_window_avgs, 
+						GreyscaleImage &ref_img, WindowMeans &ref_img_window_avgs, 
+						int min_disp, int max_disp, int block_radius, unsigned num_threads,
+						int tile_width, int tile_height, DisparityMap &disparity_map)
+{
+	ZnccRowsFunction calc_rows = select_zncc_rows(block_radius);
+	disparity_map.resize(src_img.width, src_img.height);
+	run_tiles(disparity_map.view(), tile_width, tile_height, num_threads, [&](const DisparityView &tile, int x_begin, int y_begin) {
+		calc_rows(src_img, src_img_window_avgs, ref_img, ref_img_window_avgs,
+				  min_disp, max_disp, block_radius, x_begin, y_begin, tile);
+	});
+}
 
-	int radius = 1;
-	unsigned char sentinel = 0;
-	while (true) {
-		// right side
-		int x = radius;
-		for (int y = radius; y > -radius; y--) {
-			sentinel = image.get_pixel((target_x + x), (target_y + y));
-			if (sentinel) return sentinel;
-		}
-		// bottom
-		int y = -radius;
-		for (int x = radius; x > -radius; x--) {
-			sentinel = image.get_pixel((target_x + x), (target_y + y));
-			if (sentinel) return sentinel;
-		}
-		// left side
-		x = -radius;
-		for (int y = -radius; y < radius; y++) {
-			sentinel = image.get_pixel((target_x + x), (target_y + y));
-			if (sentinel) return sentinel;
-		}
-		// top
-		y = radius;
-		for (int x = -radius; x < radius; x++) {
-			sentinel = image.get_pixel((target_x + x), (target_y + y));
-			if (sentinel) return sentinel;
+/*
+	Summed-area tables of pixel values and squared pixel values.
+	Entry (x, y) holds the sum of all pixels left of x and above y, so the tables
+	are (width + 1) x (height + 1) and any window sum takes four lookups.
+*/
+struct IntegralImage {
+	Image<uint64_t> sum;
+	Image<uint64_t> sq_sum;
+};
+
+// Fills integral, reusing its storage when it is already large enough
+void calc_integral_image(GreyscaleImage &image, IntegralImage &integral) {
+	integral.sum.assign(image.width + 1, image.height + 1, 0);
+	integral.sq_sum.assign(image.width + 1, image.height + 1, 0);
+	for (unsigned y = 0; y < image.height; y++) {
+		uint64_t row_sum = 0;
+		uint64_t row_sq_sum = 0;
+		const uint64_t *sum_above = integral.sum.row(y), *sq_sum_above = integral.sq_sum.row(y);
+		uint64_t *sum_row = integral.sum.row(y + 1), *sq_sum_row = integral.sq_sum.row(y + 1);
+		for (unsigned x = 0; x < image.width; x++) {
+			uint64_t pixel = image.row(y)[x];
+			row_sum += pixel;
+			row_sq_sum += pixel * pixel;
+			sum_row[x + 1] = sum_above[x + 1] + row_sum;
+			sq_sum_row[x + 1] = sq_sum_above[x + 1] + row_sq_sum;
 		}
-		radius++;
 	}
 }
 
-GreyscaleImage occlusion_filling(GreyscaleImage &image) {
-	int block_radius = (BLOCK_SIZE - 1) / 2;
-	GreyscaleImage occl_filled_image;
-	occl_filled_image.height = image.height;
-	occl_filled_image.width = image.width;
-	occl_filled_image.pixels = vector<unsigned char>();
+/*
+	Per-thread scratch of the disparity searches. Each search sizes the vectors it uses to
+	one slice per worker of its band runner and hands worker i slice i, like
+	BoxSums::column_sums, so a search held across frames allocates nothing after the first.
+*/
+struct SearchScratch {
+	vector<uint64_t> cross_sums;		// cross-sum tables of the integral and integer engines
+	vector<double> best_zncc;			// best score of every band pixel, integral engine
+	vector<uint64_t> best_numerators;	// best candidate of every band pixel, integer engine
+	vector<uint64_t> best_variances;
+	vector<float> costs;				// candidate scores of the subpixel, shared and cost volume searches
+};
 
-	unsigned char pixel_val;
+// Sum of the window centered at (x, y) from a summed-area table whose rows are table_stride apart
+inline uint64_t window_sum(const uint64_t *table, size_t table_stride, int x, int y, int block_radius) {
+	unsigned x0 = x - block_radius, x1 = x + block_radius + 1;
+	unsigned y0 = y - block_radius, y1 = y + block_radius + 1;
+	return table[y1*table_stride + x1] - table[y0*table_stride + x1] - table[y1*table_stride + x0] + table[y0*table_stride + x0];
+}
+
+inline uint64_t window_sum(const Image<uint64_t> &table, int x, int y, int block_radius) {
+	return window_sum(table.row(0), table.stride, x, y, block_radius);
+}
+
+/*
+	Candidate range that calc_disparity_map actually evaluates for column x.
+	Disparities are tried from min_disp upwards and the search stops at the first one
+	whose window leaves the reference image, so the range is [min_disp, last_disp] or empty.
+*/
+bool get_disparity_search_range(int x, int width, int min_disp, int max_disp, int block_radius, int &last_disp) {
+	if (min_disp < x + block_radius + 1 - width) {
+		return false;
+	}
+	last_disp = x - block_radius < max_disp ? x - block_radius : max_disp;
+	return min_disp <= last_disp;
+}
+
+/*
+	ZNCC disparity search on summed-area tables.
+	With n window pixels, source values a and reference values b:
+		zncc = (n*Sab - Sa*Sb) / sqrt((n*Saa - Sa*Sa) * (n*Sbb - Sb*Sb))
+	Sa, Saa, Sb and Sbb come from the per-image tables. Sab is built once per disparity
+	as a table of src(x, y) * ref(x - d, y) products, so every window score is O(1)
+	regardless of block size. All sums are exact integers.
+*/
+/*
+	Summed-area table of src(x, y) * ref(x - disparity, y) over rows [table_y_begin, table_y_end).
+	Row 0 of the table corresponds to table_y_begin.
+*/
+void fill_cross_sum_table(GreyscaleImage &src_img, GreyscaleImage &ref_img, int disparity,
+						  int table_y_begin, int table_y_end, uint64_t *cross_sum)
+{
+	int width = src_img.width;
+	unsigned table_width = width + 1;
+	for (int y = table_y_begin; y < table_y_end; y++) {
+		uint64_t row_sum = 0;
+		for (int x = 0; x < width; x++) {
+			int offset = x - disparity;
+			if (offset >= 0 && offset < width) {
+				row_sum += (uint64_t)src_img.row(y)[x] * ref_img.row(y)[offset];
+			}
+			unsigned index = (y - table_y_begin + 1)*table_width + x + 1;
+			cross_sum[index] = cross_sum[index - table_width] + row_sum;
+		}
+	}
+}
+
+void calc_disparity_rows_integral(GreyscaleImage &src_img, IntegralImage &src_integral,
+								  GreyscaleImage &ref_img, IntegralImage &ref_integral,
+								  int min_disp, int max_disp, int block_radius, int y_begin, int y_end, DisparityMap &disparity_map,
+								  double *best_zncc, uint64_t *cross_sum)
+{
+	int width = src_img.width;
+	int height = src_img.height;
+	unsigned table_width = width + 1;
+	int64_t window_size = (2 * block_radius + 1) * (2 * block_radius + 1);
+
+	// Cross-product table only covers the band plus the rows its windows reach
+	int table_y_begin = y_begin - block_radius > 0 ? y_begin - block_radius : 0;
+	int table_y_end = y_end + block_radius < height ? y_end + block_radius : height;
+	int window_y_begin = y_begin > block_radius ? y_begin : block_radius;
+	int window_y_end = y_end < height - block_radius ? y_end : height - block_radius;
+
+	for (int y = y_begin; y < y_end; y++) {
+		memset(disparity_map.row(y), 0, width);
+	}
+	std::fill(best_zncc, best_zncc + (y_end - y_begin) * width, 0.0);
+	std::fill(cross_sum, cross_sum + table_width * (table_y_end - table_y_begin + 1), 0);
+
+	for (int disparity = min_disp; disparity <= max_disp; disparity++) {
+		fill_cross_sum_table(src_img, ref_img, disparity, table_y_begin, table_y_end, cross_sum);
+
+		for (int y = window_y_begin; y < window_y_end; y++) {
+			for (int x = block_radius; x + block_radius < width; x++) {
+				int last_disp;
+				if (!get_disparity_search_range(x, width, min_disp, max_disp, block_radius, last_disp) || disparity > last_disp) {
+					continue;
+				}
+				int offset = x - disparity;
+				int64_t src_sum = window_sum(src_integral.sum, x, y, block_radius);
+				int64_t src_sq_sum = window_sum(src_integral.sq_sum, x, y, block_radius);
+				int64_t ref_sum = window_sum(ref_integral.sum, offset, y, block_radius);
+				int64_t ref_sq_sum = window_sum(ref_integral.sq_sum, offset, y, block_radius);
+				int64_t src_ref_sum = window_sum(cross_sum, table_width, x, y - table_y_begin, block_radius);
+
+				int64_t src_variance = window_size * src_sq_sum - src_sum * src_sum;
+				int64_t ref_variance = window_size * ref_sq_sum - ref_sum * ref_sum;
+				if (src_variance == 0 || ref_variance == 0) {
+					continue; // Flat window, ZNCC is undefined
+				}
+				double zncc = (window_size * src_ref_sum - src_sum * ref_sum) / (sqrt((double)src_variance) * sqrt((double)ref_variance));
+				if (zncc > best_zncc[(y - y_begin)*width + x]) {
+					best_zncc[(y - y_begin)*width + x] = zncc;
+					disparity_map.row(y)[x] = abs(disparity);
+				}
+			}
+		}
+	}
+}
+
+// Per-thread sizes of the cross-sum table and the band planes of a contiguous band
+inline void integral_band_sizes(GreyscaleImage &src_img, int block_radius, unsigned num_threads,
+								size_t &band_pixels, size_t &table_size) {
+	int band_rows = contiguous_band_rows(src_img.height, num_threads);
+	band_pixels = (size_t)band_rows * src_img.width;
+	table_size = (size_t)(src_img.width + 1) * (band_rows + 2 * block_radius + 1);
+}
+
+// Writes into disparity_map like calc_disparity_map, scratch keeps its storage between calls
+void calc_disparity_map_integral(GreyscaleImage &src_img, IntegralImage &src_integral,
+								 GreyscaleImage &ref_img, IntegralImage &ref_integral,
+								 int min_disp, int max_disp, int block_radius, unsigned num_threads,
+								 SearchScratch &scratch, DisparityMap &disparity_map)
+{
+	size_t band_pixels, table_size;
+	integral_band_sizes(src_img, block_radius, num_threads, band_pixels, table_size);
+	scratch.best_zncc.resize(band_pixels * std::max(num_threads, 1u));
+	scratch.cross_sums.resize(table_size * std::max(num_threads, 1u));
+	disparity_map.resize(src_img.width, src_img.height);
+	run_contiguous_row_bands(src_img.height, num_threads, [&](unsigned worker, int y_begin, int y_end) {
+		calc_disparity_rows_integral(src_img, src_integral, ref_img, ref_integral,
+									 min_disp, max_disp, block_radius, y_begin, y_end, disparity_map,
+									 &scratch.best_zncc[worker * band_pixels], &scratch.cross_sums[worker * table_size]);
+	});
+}
+
+// Unsigned 128-bit value for exact ZNCC comparisons
+struct Wide128 {
+	uint64_t hi, lo;
+};
+
+inline Wide128 multiply_wide(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+	unsigned __int128 product = (unsigned __int128)a * b;
+	Wide128 result = { (uint64_t)(product >> 64), (uint64_t)product };
+#else
+	uint64_t a_lo = a & 0xffffffff, a_hi = a >> 32;
+	uint64_t b_lo = b & 0xffffffff, b_hi = b >> 32;
+	uint64_t lo_lo = a_lo * b_lo, hi_lo = a_hi * b_lo, lo_hi = a_lo * b_hi, hi_hi = a_hi * b_hi;
+	uint64_t middle = (lo_lo >> 32) + (hi_lo & 0xffffffff) + lo_hi;
+	Wide128 result = { hi_hi + (hi_lo >> 32) + (middle >> 32), (middle << 32) | (lo_lo & 0xffffffff) };
+#endif
+	return result;
+}
+
+// a * a * b, which must be below 2^128
+inline Wide128 multiply_square(uint64_t a, uint64_t b) {
+	Wide128 square = multiply_wide(a, a);
+	Wide128 result = multiply_wide(square.lo, b);
+	result.hi += square.hi * b;
+	return result;
+}
+
+inline bool wide_greater(Wide128 a, Wide128 b) {
+	return a.hi > b.hi || (a.hi == b.hi && a.lo > b.lo);
+}
+
+/*
+	Integral-image search without division or sqrt. For a fixed source pixel the source
+	variance is a common factor, so candidate k beats the current best exactly when
+		num_k > 0 and num_k^2 * var_best > num_best^2 * var_k
+	with num = n*Sab - Sa*Sb and var = n*Sbb - Sb*Sb, all exact integers. The products stay
+	below 2^128 for windows up to 25x25. Results are the same on every compiler.
+*/
+void calc_disparity_rows_integer(GreyscaleImage &src_img, IntegralImage &src_integral,
+								 GreyscaleImage &ref_img, IntegralImage &ref_integral,
+								 int min_disp, int max_disp, int block_radius, int y_begin, int y_end, DisparityMap &disparity_map,
+								 uint64_t *best_numerator, uint64_t *best_variance, uint64_t *cross_sum)
+{
+	int width = src_img.width;
+	int height = src_img.height;
+	unsigned table_width = width + 1;
+	int64_t window_size = (2 * block_radius + 1) * (2 * block_radius + 1);
+
+	int table_y_begin = y_begin - block_radius > 0 ? y_begin - block_radius : 0;
+	int table_y_end = y_end + block_radius < height ? y_end + block_radius : height;
+	int window_y_begin = y_begin > block_radius ? y_begin : block_radius;
+	int window_y_end = y_end < height - block_radius ? y_end : height - block_radius;
+
+	for (int y = y_begin; y < y_end; y++) {
+		memset(disparity_map.row(y), 0, width);
+	}
+	// Best candidate so far as (numerator, reference variance); (0, 1) accepts any positive ZNCC
+	std::fill(best_numerator, best_numerator + (y_end - y_begin) * width, 0);
+	std::fill(best_variance, best_variance + (y_end - y_begin) * width, 1);
+	std::fill(cross_sum, cross_sum + table_width * (table_y_end - table_y_begin + 1), 0);
+
+	for (int disparity = min_disp; disparity <= max_disp; disparity++) {
+		fill_cross_sum_table(src_img, ref_img, disparity, table_y_begin, table_y_end, cross_sum);
+
+		for (int y = window_y_begin; y < window_y_end; y++) {
+			for (int x = block_radius; x + block_radius < width; x++) {
+				int last_disp;
+				if (!get_disparity_search_range(x, width, min_disp, max_disp, block_radius, last_disp) || disparity > last_disp) {
+					continue;
+				}
+				int offset = x - disparity;
+				int64_t src_sum = window_sum(src_integral.sum, x, y, block_radius);
+				int64_t src_sq_sum = window_sum(src_integral.sq_sum, x, y, block_radius);
+				if (window_size * src_sq_sum == src_sum * src_sum) {
+					continue; // Flat source window, ZNCC is undefined
+				}
+				int64_t ref_sum = window_sum(ref_integral.sum, offset, y, block_radius);
+				int64_t ref_sq_sum = window_sum(ref_integral.sq_sum, offset, y, block_radius);
+				int64_t src_ref_sum = window_sum(cross_sum, table_width, x, y - table_y_begin, block_radius);
+
+				int64_t numerator = window_size * src_ref_sum - src_sum * ref_sum;
+				int64_t ref_variance = window_size * ref_sq_sum - ref_sum * ref_sum;
+				if (numerator <= 0 || ref_variance == 0) {
+					continue;
+				}
+				unsigned band_index = (y - y_begin)*width + x;
+				if (wide_greater(multiply_square(numerator, best_variance[band_index]),
+								 multiply_square(best_numerator[band_index], ref_variance))) {
+					best_numerator[band_index] = numerator;
+					best_variance[band_index] = ref_variance;
+					disparity_map.row(y)[x] = abs(disparity);
+				}
+			}
+		}
+	}
+}
+
+// Writes into disparity_map like calc_disparity_map_integral
+void calc_disparity_map_integer(GreyscaleImage &src_img, IntegralImage &src_integral,
+								GreyscaleImage &ref_img, IntegralImage &ref_integral,
+								int min_disp, int max_disp, int block_radius, unsigned num_threads,
+								SearchScratch &scratch, DisparityMap &disparity_map)
+{
+	size_t band_pixels, table_size;
+	integral_band_sizes(src_img, block_radius, num_threads, band_pixels, table_size);
+	scratch.best_numerators.resize(band_pixels * std::max(num_threads, 1u));
+	scratch.best_variances.resize(band_pixels * std::max(num_threads, 1u));
+	scratch.cross_sums.resize(table_size * std::max(num_threads, 1u));
+	disparity_map.resize(src_img.width, src_img.height);
+	run_contiguous_row_bands(src_img.height, num_threads, [&](unsigned worker, int y_begin, int y_end) {
+		calc_disparity_rows_integer(src_img, src_integral, ref_img, ref_integral,
+									min_disp, max_disp, block_radius, y_begin, y_end, disparity_map,
+									&scratch.best_numerators[worker * band_pixels], &scratch.best_variances[worker * band_pixels],
+									&scratch.cross_sums[worker * table_size]);
+	});
+}
+
+/*
+	Scalar ZNCC of one candidate, rounded exactly like the inner loop of calc_disparity_rows:
+	the numerator is summed in float while pow() and sqrt() promote the denominator terms
+	to double. src_diffs holds the zero-mean source window, src_den_sqrt its root of squares.
+*/
+template <int FIXED_RADIUS = 0>
+inline float zncc_candidate(const float *src_diffs, double src_den_sqrt, const WindowView &ref_window, float ref_mean)
+{
+	const int radius = FIXED_RADIUS > 0 ? FIXED_RADIUS : ref_window.radius;
+	float numerator_sum = 0;
+	float denominator_sum_R = 0;
+	int i = 0;
+	for (int wy = 0; wy <= 2 * radius; wy++) {
+		const unsigned char *row = ref_window.row(wy);
+		for (int wx = 0; wx <= 2 * radius; wx++, i++) {
+			float ref_window_diff = row[wx] - ref_mean;
+			numerator_sum += src_diffs[i] * ref_window_diff;
+			denominator_sum_R = (float)(denominator_sum_R + (double)ref_window_diff * ref_window_diff);
+		}
+	}
+	return (float)(numerator_sum / (src_den_sqrt * sqrt((double)denominator_sum_R)));
+}
+
+/*
+	Vectorized candidate search. One register holds ZNCC_SIMD_LANES consecutive disparities:
+	their reference windows start at adjacent columns, so a single unaligned load fetches the
+	same window pixel for every lane (lane k scores disparity d0 + LANES-1 - k). Each lane
+	repeats the scalar rounding of zncc_candidate, and the running best score and disparity
+	stay in registers until the group loop ends. Groups never reach past last_disp; the
+	remaining candidates are left to the scalar tail.
+	Returns the first disparity that was not evaluated.
+*/
+#if ZNCC_SIMD_LANES == 8
+template <int FIXED_RADIUS = 0>
+int search_disparity_groups(const float *src_diffs, double src_den_sqrt, const unsigned char *ref_pixels, int ref_stride,
+							int x, int y, int block_radius, const float *ref_row_means,
+							int first_disp, int last_disp, float &best_zncc, int &best_disp)
+{
+	const int radius = FIXED_RADIUS > 0 ? FIXED_RADIUS : block_radius;
+	__m256 best_score = _mm256_setzero_ps();
+	__m256i best_lane_disp = _mm256_setzero_si256();
+	__m256d src_den = _mm256_set1_pd(src_den_sqrt);
+	int disparity = first_disp;
+	for (; disparity + 7 <= last_disp; disparity += 8) {
+		int base = x - disparity - 7; // reference column of lane 0
+		__m256 means = _mm256_loadu_ps(ref_row_means + base);
+		__m256 numerator = _mm256_setzero_ps();
+		__m128 denominator_lo = _mm_setzero_ps();
+		__m128 denominator_hi = _mm_setzero_ps();
+		int i = 0;
+		for (int wy = y - radius; wy <= y + radius; wy++) {
+			const unsigned char *row = ref_pixels + wy*ref_stride + base - radius;
+			for (int wx = 0; wx <= 2 * radius; wx++, i++) {
+				__m256i ref_bytes = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(row + wx)));
+				__m256 ref_diff = _mm256_sub_ps(_mm256_cvtepi32_ps(ref_bytes), means);
+				numerator = _mm256_add_ps(numerator, _mm256_mul_ps(_mm256_set1_ps(src_diffs[i]), ref_diff));
+				__m256d diff_lo = _mm256_cvtps_pd(_mm256_castps256_ps128(ref_diff));
+				__m256d diff_hi = _mm256_cvtps_pd(_mm256_extractf128_ps(ref_diff, 1));
+				denominator_lo = _mm256_cvtpd_ps(_mm256_add_pd(_mm256_cvtps_pd(denominator_lo), _mm256_mul_pd(diff_lo, diff_lo)));
+				denominator_hi = _mm256_cvtpd_ps(_mm256_add_pd(_mm256_cvtps_pd(denominator_hi), _mm256_mul_pd(diff_hi, diff_hi)));
+			}
+		}
+		__m128 zncc_lo = _mm256_cvtpd_ps(_mm256_div_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(numerator)),
+							_mm256_mul_pd(src_den, _mm256_sqrt_pd(_mm256_cvtps_pd(denominator_lo)))));
+		__m128 zncc_hi = _mm256_cvtpd_ps(_mm256_div_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(numerator, 1)),
+							_mm256_mul_pd(src_den, _mm256_sqrt_pd(_mm256_cvtps_pd(denominator_hi)))));
+		__m256 zncc = _mm256_set_m128(zncc_hi, zncc_lo);
+
+		__m256i lane_disp = _mm256_add_epi32(_mm256_set1_epi32(disparity), _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+		__m256 better = _mm256_cmp_ps(zncc, best_score, _CMP_GT_OQ);
+		best_score = _mm256_blendv_ps(best_score, zncc, better);
+		best_lane_disp = _mm256_blendv_epi8(best_lane_disp, lane_disp, _mm256_castps_si256(better));
+	}
+
+	float lane_scores[8];
+	int lane_disps[8];
+	_mm256_storeu_ps(lane_scores, best_score);
+	_mm256_storeu_si256((__m256i *)lane_disps, best_lane_disp);
+	for (int k = 0; k < 8; k++) {
+		// Ties go to the disparity that the scalar loop would have met first
+		if (lane_scores[k] > best_zncc || (lane_scores[k] == best_zncc && lane_scores[k] > 0 && lane_disps[k] < best_disp)) {
+			best_zncc = lane_scores[k];
+			best_disp = lane_disps[k];
+		}
+	}
+	return disparity;
+}
+#elif ZNCC_SIMD_LANES == 4
+template <int FIXED_RADIUS = 0>
+int search_disparity_groups(const float *src_diffs, double src_den_sqrt, const unsigned char *ref_pixels, int ref_stride,
+							int x, int y, int block_radius, const float *ref_row_means,
+							int first_disp, int last_disp, float &best_zncc, int &best_disp)
+{
+	const int radius = FIXED_RADIUS > 0 ? FIXED_RADIUS : block_radius;
+	__m128 best_score = _mm_setzero_ps();
+	__m128i best_lane_disp = _mm_setzero_si128();
+	__m128d src_den = _mm_set1_pd(src_den_sqrt);
+	int disparity = first_disp;
+	for (; disparity + 3 <= last_disp; disparity += 4) {
+		int base = x - disparity - 3; // reference column of lane 0
+		__m128 means = _mm_loadu_ps(ref_row_means + base);
+		__m128 numerator = _mm_setzero_ps();
+		__m128 denominator_lo = _mm_setzero_ps();
+		__m128 denominator_hi = _mm_setzero_ps();
+		int i = 0;
+		for (int wy = y - radius; wy <= y + radius; wy++) {
+			const unsigned char *row = ref_pixels + wy*ref_stride + base - radius;
+			for (int wx = 0; wx <= 2 * radius; wx++, i++) {
+				int packed;
+				memcpy(&packed, row + wx, sizeof(packed));
+				__m128 ref_diff = _mm_sub_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed))), means);
+				numerator = _mm_add_ps(numerator, _mm_mul_ps(_mm_set1_ps(src_diffs[i]), ref_diff));
+				__m128d diff_lo = _mm_cvtps_pd(ref_diff);
+				__m128d diff_hi = _mm_cvtps_pd(_mm_movehl_ps(ref_diff, ref_diff));
+				denominator_lo = _mm_cvtpd_ps(_mm_add_pd(_mm_cvtps_pd(denominator_lo), _mm_mul_pd(diff_lo, diff_lo)));
+				denominator_hi = _mm_cvtpd_ps(_mm_add_pd(_mm_cvtps_pd(denominator_hi), _mm_mul_pd(diff_hi, diff_hi)));
+			}
+		}
+		__m128 zncc_lo = _mm_cvtpd_ps(_mm_div_pd(_mm_cvtps_pd(numerator),
+							_mm_mul_pd(src_den, _mm_sqrt_pd(_mm_cvtps_pd(denominator_lo)))));
+		__m128 zncc_hi = _mm_cvtpd_ps(_mm_div_pd(_mm_cvtps_pd(_mm_movehl_ps(numerator, numerator)),
+							_mm_mul_pd(src_den, _mm_sqrt_pd(_mm_cvtps_pd(denominator_hi)))));
+		__m128 zncc = _mm_movelh_ps(zncc_lo, zncc_hi);
+
+		__m128i lane_disp = _mm_add_epi32(_mm_set1_epi32(disparity), _mm_setr_epi32(3, 2, 1, 0));
+		__m128 better = _mm_cmpgt_ps(zncc, best_score);
+		best_score = _mm_blendv_ps(best_score, zncc, better);
+		best_lane_disp = _mm_blendv_epi8(best_lane_disp, lane_disp, _mm_castps_si128(better));
+	}
+
+	float lane_scores[4];
+	int lane_disps[4];
+	_mm_storeu_ps(lane_scores, best_score);
+	_mm_storeu_si128((__m128i *)lane_disps, best_lane_disp);
+	for (int k = 0; k < 4; k++) {
+		// Ties go to the disparity that the scalar loop would have met first
+		if (lane_scores[k] > best_zncc || (lane_scores[k] == best_zncc && lane_scores[k] > 0 && lane_disps[k] < best_disp)) {
+			best_zncc = lane_scores[k];
+			best_disp = lane_disps[k];
+		}
+	}
+	return disparity;
+}
+#endif
+
+/*
+	Same search as calc_disparity_rows with the candidate loop vectorized across disparities.
+	Window means come from the same maps, so the chosen disparities are identical to the
+	direct engine. Without AVX2 or SSE4.1 only the scalar candidate loop is compiled.
+	FIXED_RADIUS works as in calc_disparity_rows.
+*/
+template <int FIXED_RADIUS = 0>
+void calc_disparity_rows_simd(GreyscaleImage &src_img, const WindowMeans &src_img_window_avgs,
+							  GreyscaleImage &ref_img, const WindowMeans &ref_img_window_avgs,
+								  int min_disp, int max_disp, int block_radius, int x_begin, int y_begin,
+								  const DisparityView &tile)
+{
+	const int radius = FIXED_RADIUS > 0 ? FIXED_RADIUS : block_radius;
+	int width = src_img.width;
+	int height = src_img.height;
+	int x_end = x_begin + tile.width, y_end = y_begin + tile.height;
+	float src_diffs[MAX_BLOCK_SIZE * MAX_BLOCK_SIZE];
+
+	for (int y = y_begin; y < y_end; y++) {
+		unsigned char *tile_row = tile.row(y - y_begin) - x_begin;
+		if (y - radius < 0 || y + radius >= height) {
+			memset(tile_row + x_begin, 0, tile.width);
+			continue;
+		}
+		const float *ref_row_means = ref_img_window_avgs.row(y);
+
+		for (int x = x_begin; x < x_end; x++) {
+			int last_disp;
+			if (x - radius < 0 || x + radius >= width ||
+				!get_disparity_search_range(x, width, min_disp, max_disp, radius, last_disp)) {
+				tile_row[x] = 0;
+			continue;
+		}
+
+			// Zero-mean source window and its sum of squares, shared by every candidate
+			float src_window_mean = src_img_window_avgs.row(y)[x];
+			float denominator_sum_L = 0;
+			WindowView src_window = get_window_view(src_img, x, y, radius);
+			int i = 0;
+			for (int wy = 0; wy <= 2 * radius; wy++) {
+				const unsigned char *row = src_window.row(wy);
+				for (int wx = 0; wx <= 2 * radius; wx++, i++) {
+					src_diffs[i] = row[wx] - src_window_mean;
+					denominator_sum_L = (float)(denominator_sum_L + (double)src_diffs[i] * src_diffs[i]);
+				}
+			}
+			double src_den_sqrt = sqrt((double)denominator_sum_L);
+
+			float best_zncc = 0;
+			int best_disp = 0;
+			int disparity = min_disp;
+#if ZNCC_SIMD_LANES > 1
+			disparity = search_disparity_groups<FIXED_RADIUS>(src_diffs, src_den_sqrt, ref_img.row(0), ref_img.stride, x, y, radius,
+															  ref_row_means, min_disp, last_disp, best_zncc, best_disp);
+#endif
+			for (; disparity <= last_disp; disparity++) {
+				float zncc = zncc_candidate<FIXED_RADIUS>(src_diffs, src_den_sqrt, get_window_view(ref_img, x - disparity, y, radius),
+														  ref_row_means[x - disparity]);
+				if (zncc > best_zncc) {
+					best_zncc = zncc;
+					best_disp = disparity;
+				}
+			}
+			tile_row[x] = abs(best_disp);
+		}
+	}
+}
+
+// Dispatch of the simd kernel, see select_zncc_rows
+ZnccRowsFunction select_zncc_rows_simd(int block_radius) {
+	switch (block_radius) {
+	case 2: return calc_disparity_rows_simd<2>;
+	case 3: return calc_disparity_rows_simd<3>;
+	case 4: return calc_disparity_rows_simd<4>;
+	case 7: return calc_disparity_rows_simd<7>;
+	case 12: return calc_disparity_rows_simd<12>;
+	default: return calc_disparity_rows_simd<0>;
+	}
+}
+
+// Writes into disparity_map like calc_disparity_map
+void calc_disparity_map_simd(GreyscaleImage &src_img, WindowMeans &src_img_window_avgs,
+							 GreyscaleImage &ref_img, WindowMeans &ref_img_window_avgs,
+							 int min_disp, int max_disp, int block_radius, unsigned num_threads,
+							 int tile_width, int tile_height, DisparityMap &disparity_map)
+{
+	ZnccRowsFunction calc_rows = select_zncc_rows_simd(block_radius);
+	disparity_map.resize(src_img.width, src_img.height);
+	run_tiles(disparity_map.view(), tile_width, tile_height, num_threads, [&](const DisparityView &tile, int x_begin, int y_begin) {
+		calc_rows(src_img, src_img_window_avgs, ref_img, ref_img_window_avgs,
+				  min_disp, max_disp, block_radius, x_begin, y_begin, tile);
+	});
+}
+
+/*
+	Per-window statistics computed once per image. inv_deviation is
+	1 / sqrt(sum of squared deviations from the mean), i.e. the inverse standard
+	deviation scaled by 1 / sqrt(window size), so a window multiplied by it has unit norm.
+	Border pixels that cannot be windowed and flat windows have inv_deviation 0.
+*/
+struct WindowDescriptors {
+	Image<float> mean;
+	Image<float> inv_deviation;
+};
+
+// Fills descriptors, with box as scratch space for the window sums; both keep their storage between calls
+void calc_window_descriptors(GreyscaleImage &image, int block_radius, unsigned num_threads, BoxSums &box, WindowDescriptors &descriptors) {
+	calc_box_sums(image, block_radius, true, num_threads, box);
+	descriptors.mean.assign(image.width, image.height, 0);
+	descriptors.inv_deviation.assign(image.width, image.height, 0);
+
+	int64_t window_size = (2 * block_radius + 1) * (2 * block_radius + 1);
+	for (int y = block_radius; y + block_radius < (int)image.height; y++) {
+		const uint32_t *sum_row = box.sum.row(y), *sq_sum_row = box.sq_sum.row(y);
+		float *mean_row = descriptors.mean.row(y), *inv_deviation_row = descriptors.inv_deviation.row(y);
+		for (int x = block_radius; x + block_radius < (int)image.width; x++) {
+			int64_t sum = sum_row[x];
+			int64_t sq_sum = sq_sum_row[x];
+			int64_t variance = window_size * sq_sum - sum * sum; // window_size * sum of squared deviations
+			mean_row[x] = (float)sum / (float)window_size;
+			if (variance > 0) {
+				inv_deviation_row[x] = (float)sqrt((double)window_size / (double)variance);
+			}
+		}
+	}
+}
+
+// Descriptor ZNCC of a single candidate whose reference window is centered at offset
+template <int FIXED_RADIUS = 0>
+inline float descriptor_candidate(const float *src_unit, const WindowView &ref_window, float ref_inv_deviation)
+{
+	const int radius = FIXED_RADIUS > 0 ? FIXED_RADIUS : ref_window.radius;
+	float dot = 0;
+	int i = 0;
+	for (int wy = 0; wy <= 2 * radius; wy++) {
+		const unsigned char *row = ref_window.row(wy);
+		for (int wx = 0; wx <= 2 * radius; wx++, i++) {
+			dot += src_unit[i] * row[wx];
+		}
+	}
+	return dot * ref_inv_deviation;
+}
+
+/*
+	Descriptor scores of ZNCC_SIMD_LANES consecutive disparities, laid out like
+	search_disparity_groups: lane k scores disparity + LANES-1 - k.
+	src_unit is the zero-mean, unit-norm source window. Since its values sum to zero, the
+	reference mean drops out and ZNCC is its dot product with the raw reference window times
+	the reference inv_deviation.
+*/
+#if ZNCC_SIMD_LANES == 8
+template <int FIXED_RADIUS = 0>
+inline __m256 descriptor_group_scores(const float *src_unit, const unsigned char *ref_pixels, int ref_stride,
+									  int x, int y, int block_radius, const float *ref_row_inv_deviation, int disparity)
+{
+	const int radius = FIXED_RADIUS > 0 ? FIXED_RADIUS : block_radius;
+	int base = x - disparity - 7; // reference column of lane 0
+	// Two accumulators halve the add dependency chain
+	__m256 dot_even = _mm256_setzero_ps();
+	__m256 dot_odd = _mm256_setzero_ps();
+	int i = 0;
+	for (int wy = y - radius; wy <= y + radius; wy++) {
+		const unsigned char *row = ref_pixels + wy*ref_stride + base - radius;
+		int wx = 0;
+		for (; wx < 2 * radius; wx += 2, i += 2) {
+			__m256 ref_even = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(row + wx))));
+			__m256 ref_odd = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(row + wx + 1))));
+			dot_even = _mm256_add_ps(dot_even, _mm256_mul_ps(_mm256_set1_ps(src_unit[i]), ref_even));
+			dot_odd = _mm256_add_ps(dot_odd, _mm256_mul_ps(_mm256_set1_ps(src_unit[i + 1]), ref_odd));
+		}
+		__m256 ref_last = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(row + wx))));
+		dot_even = _mm256_add_ps(dot_even, _mm256_mul_ps(_mm256_set1_ps(src_unit[i]), ref_last));
+		i++;
+	}
+	return _mm256_mul_ps(_mm256_add_ps(dot_even, dot_odd), _mm256_loadu_ps(ref_row_inv_deviation + base));
+}
+
+inline void store_group_scores(float *lane_scores, __m256 scores) {
+	_mm256_storeu_ps(lane_scores, scores);
+}
+
+template <int FIXED_RADIUS = 0>
+int search_descriptor_groups(const float *src_unit, const unsigned char *ref_pixels, int ref_stride,
+							 int x, int y, int block_radius, const float *ref_row_inv_deviation,
+							 int first_disp, int last_disp, float &best_zncc, int &best_disp)
+{
+	const int radius = FIXED_RADIUS > 0 ? FIXED_RADIUS : block_radius;
+	__m256 best_score = _mm256_setzero_ps();
+	__m256i best_lane_disp = _mm256_setzero_si256();
+	int disparity = first_disp;
+	for (; disparity + 7 <= last_disp; disparity += 8) {
+		__m256 zncc = descriptor_group_scores<FIXED_RADIUS>(src_unit, ref_pixels, ref_stride, x, y, radius, ref_row_inv_deviation, disparity);
+		__m256i lane_disp = _mm256_add_epi32(_mm256_set1_epi32(disparity), _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+		__m256 better = _mm256_cmp_ps(zncc, best_score, _CMP_GT_OQ);
+		best_score = _mm256_blendv_ps(best_score, zncc, better);
+		best_lane_disp = _mm256_blendv_epi8(best_lane_disp, lane_disp, _mm256_castps_si256(better));
+	}
+
+	float lane_scores[8];
+	int lane_disps[8];
+	_mm256_storeu_ps(lane_scores, best_score);
+	_mm256_storeu_si256((__m256i *)lane_disps, best_lane_disp);
+	for (int k = 0; k < 8; k++) {
+		if (lane_scores[k] > best_zncc || (lane_scores[k] == best_zncc && lane_scores[k] > 0 && lane_disps[k] < best_disp)) {
+			best_zncc = lane_scores[k];
+			best_disp = lane_disps[k];
+		}
+	}
+	return disparity;
+}
+#elif ZNCC_SIMD_LANES == 4
+template <int FIXED_RADIUS = 0>
+inline __m128 descriptor_group_scores(const float *src_unit, const unsigned char *ref_pixels, int ref_stride,
+									  int x, int y, int block_radius, const float *ref_row_inv_deviation, int disparity)
+{
+	const int radius = FIXED_RADIUS > 0 ? FIXED_RADIUS : block_radius;
+	int base = x - disparity - 3; // reference column of lane 0
+	__m128 dot = _mm_setzero_ps();
+	int i = 0;
+	for (int wy = y - radius; wy <= y + radius; wy++) {
+		const unsigned char *row = ref_pixels + wy*ref_stride + base - radius;
+		for (int wx = 0; wx <= 2 * radius; wx++, i++) {
+			int packed;
+			memcpy(&packed, row + wx, sizeof(packed));
+			__m128 ref_vals = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed)));
+			dot = _mm_add_ps(dot, _mm_mul_ps(_mm_set1_ps(src_unit[i]), ref_vals));
+		}
+	}
+	return _mm_mul_ps(dot, _mm_loadu_ps(ref_row_inv_deviation + base));
+}
+
+inline void store_group_scores(float *lane_scores, __m128 scores) {
+	_mm_storeu_ps(lane_scores, scores);
+}
+
+template <int FIXED_RADIUS = 0>
+int search_descriptor_groups(const float *src_unit, const unsigned char *ref_pixels, int ref_stride,
+							 int x, int y, int block_radius, const float *ref_row_inv_deviation,
+							 int first_disp, int last_disp, float &best_zncc, int &best_disp)
+{
+	const int radius = FIXED_RADIUS > 0 ? FIXED_RADIUS : block_radius;
+	__m128 best_score = _mm_setzero_ps();
+	__m128i best_lane_disp = _mm_setzero_si128();
+	int disparity = first_disp;
+	for (; disparity + 3 <= last_disp; disparity += 4) {
+		__m128 zncc = descriptor_group_scores<FIXED_RADIUS>(src_unit, ref_pixels, ref_stride, x, y, radius, ref_row_inv_deviation, disparity);
+		__m128i lane_disp = _mm_add_epi32(_mm_set1_epi32(disparity), _mm_setr_epi32(3, 2, 1, 0));
+		__m128 better = _mm_cmpgt_ps(zncc, best_score);
+		best_score = _mm_blendv_ps(best_score, zncc, better);
+		best_lane_disp = _mm_blendv_epi8(best_lane_disp, lane_disp, _mm_castps_si128(better));
+	}
+
+	float lane_scores[4];
+	int lane_disps[4];
+	_mm_storeu_ps(lane_scores, best_score);
+	_mm_storeu_si128((__m128i *)lane_disps, best_lane_disp);
+	for (int k = 0; k < 4; k++) {
+		if (lane_scores[k] > best_zncc || (lane_scores[k] == best_zncc && lane_scores[k] > 0 && lane_disps[k] < best_disp)) {
+			best_zncc = lane_scores[k];
+			best_disp = lane_disps[k];
+		}
+	}
+	return disparity;
+}
+#endif
+
+// Zero-mean, unit-norm copy of the source window centered at (x, y)
+template <int FIXED_RADIUS = 0>
+inline void fill_unit_window(GreyscaleImage &src_img, const WindowDescriptors &src_descriptors, int x, int y, int block_radius, float *src_unit) {
+	const int radius = FIXED_RADIUS > 0 ? FIXED_RADIUS : block_radius;
+	float src_mean = src_descriptors.mean.row(y)[x];
+	float src_inv_deviation = src_descriptors.inv_deviation.row(y)[x];
+	WindowView src_window = get_window_view(src_img, x, y, radius);
+	int i = 0;
+	for (int wy = 0; wy <= 2 * radius; wy++) {
+		const unsigned char *row = src_window.row(wy);
+		for (int wx = 0; wx <= 2 * radius; wx++, i++) {
+			src_unit[i] = (row[wx] - src_mean) * src_inv_deviation;
+		}
+	}
+}
+
+/*
+	Disparity search on precomputed window descriptors: one dot product and one multiply per candidate.
+	FIXED_RADIUS > 0 compiles the window loops for that radius so they can be fully unrolled;
+	0 is the generic version that reads block_radius at runtime.
+*/
+template <int FIXED_RADIUS = 0>
+void calc_disparity_rows_descriptor(GreyscaleImage &src_img, const WindowDescriptors &src_descriptors,
+									GreyscaleImage &ref_img, const WindowDescriptors &ref_descriptors,
+									int min_disp, int max_disp, int block_radius, int x_begin, int y_begin,
+									const DisparityView &tile)
+{
+	const int radius = FIXED_RADIUS > 0 ? FIXED_RADIUS : block_radius;
+	int width = src_img.width;
+	int height = src_img.height;
+	int x_end = x_begin + tile.width, y_end = y_begin + tile.height;
+	float src_unit[MAX_BLOCK_SIZE * MAX_BLOCK_SIZE];
+
+	for (int y = y_begin; y < y_end; y++) {
+		unsigned char *tile_row = tile.row(y - y_begin) - x_begin;
+		if (y - radius < 0 || y + radius >= height) {
+			memset(tile_row + x_begin, 0, tile.width);
+			continue;
+		}
+		const float *ref_row_inv_deviation = ref_descriptors.inv_deviation.row(y);
+
+		for (int x = x_begin; x < x_end; x++) {
+			int last_disp;
+			if (x - radius < 0 || x + radius >= width ||
+				!get_disparity_search_range(x, width, min_disp, max_disp, radius, last_disp)) {
+				tile_row[x] = 0;
+				continue;
+			}
+
+			fill_unit_window<FIXED_RADIUS>(src_img, src_descriptors, x, y, radius, src_unit);
+
+			float best_zncc = 0;
+			int best_disp = 0;
+			int disparity = min_disp;
+#if ZNCC_SIMD_LANES > 1
+			disparity = search_descriptor_groups<FIXED_RADIUS>(src_unit, ref_img.row(0), ref_img.stride, x, y, radius,
+												 ref_row_inv_deviation, min_disp, last_disp, best_zncc, best_disp);
+#endif
+			for (; disparity <= last_disp; disparity++) {
+				float zncc = descriptor_candidate<FIXED_RADIUS>(src_unit, get_window_view(ref_img, x - disparity, y, radius),
+																		  ref_row_inv_deviation[x - disparity]);
+				if (zncc > best_zncc) {
+					best_zncc = zncc;
+					best_disp = disparity;
+				}
+			}
+			tile_row[x] = abs(best_disp);
+		}
+	}
+}
+
+typedef void (*DescriptorRowsFunction)(GreyscaleImage &, const WindowDescriptors &, GreyscaleImage &, const WindowDescriptors &,
+									   int, int, int, int, int, const DisparityView &);
+
+// Kernel specialized for the common window sizes 5, 7, 9, 15 and 25, generic otherwise
+DescriptorRowsFunction select_descriptor_rows(int block_radius) {
+	switch (block_radius) {
+	case 2: return calc_disparity_rows_descriptor<2>;
+	case 3: return calc_disparity_rows_descriptor<3>;
+	case 4: return calc_disparity_rows_descriptor<4>;
+	case 7: return calc_disparity_rows_descriptor<7>;
+	case 12: return calc_disparity_rows_descriptor<12>;
+	default: return calc_disparity_rows_descriptor<0>;
+	}
+}
+
+// Writes into disparity_map like calc_disparity_map
+void calc_disparity_map_descriptor(GreyscaleImage &src_img, WindowDescriptors &src_descriptors,
+								   GreyscaleImage &ref_img, WindowDescriptors &ref_descriptors,
+								   int min_disp, int max_disp, int block_radius, unsigned num_threads,
+								   int tile_width, int tile_height, DisparityMap &disparity_map)
+{
+	DescriptorRowsFunction calc_rows = select_descriptor_rows(block_radius);
+	disparity_map.resize(src_img.width, src_img.height);
+	run_tiles(disparity_map.view(), tile_width, tile_height, num_threads, [&](const DisparityView &tile, int x_begin, int y_begin) {
+		calc_rows(src_img, src_descriptors, ref_img, ref_descriptors,
+				  min_disp, max_disp, block_radius, x_begin, y_begin, tile);
+	});
+}
+
+/*
+	Descriptor search that skips candidates which cannot beat the best score.
+	After each window row the remaining rows contribute sum(u * (r - mean)) + mean * sum(u)
+	to the dot product. By Cauchy-Schwarz the first term is at most the norm of the source
+	rows still to come divided by the reference inv_deviation, so the score is bounded by the
+	rows seen so far, the mean term and that norm.
+	The previous pixel's best disparity is scored first and a candidate (or a whole SIMD group)
+	is dropped as soon as its bound falls below that score. The remaining candidates are then
+	searched in the usual order with the usual kernels, so the map matches the unpruned search.
+*/
+#define PRUNE_MARGIN 1e-5f // slack for float rounding between the bound and the summed score
+
+// Bound of the descriptor score after window rows 0..wy, see calc_disparity_rows_pruned
+inline float descriptor_score_bound(float dot, float ref_mean, float ref_inv_deviation, float rest_sum, float rest_norm) {
+	return (dot + ref_mean * rest_sum) * ref_inv_deviation + rest_norm;
+}
+
+/*
+	descriptor_group_scores with a bound check after every window row. Returns false as soon
+	as no lane can reach prune_below; otherwise scores holds exactly what descriptor_group_scores
+	would have returned.
+*/
+#if ZNCC_SIMD_LANES == 8
+inline bool descriptor_group_scores_pruned(const float *src_unit, const unsigned char *ref_pixels, int ref_stride,
+										   int x, int y, int block_radius, const float *ref_row_mean, const float *ref_row_inv_deviation,
+										   int disparity, const float *rest_sums, const float *rest_norms, float prune_below,
+										   __m256 &scores)
+{
+	int base = x - disparity - 7; // reference column of lane 0
+	__m256 means = _mm256_loadu_ps(ref_row_mean + base);
+	__m256 inv_deviations = _mm256_loadu_ps(ref_row_inv_deviation + base);
+	__m256 floor = _mm256_set1_ps(prune_below);
+	__m256 dot_even = _mm256_setzero_ps();
+	__m256 dot_odd = _mm256_setzero_ps();
+	int i = 0;
+	for (int wy = 0; wy <= 2 * block_radius; wy++) {
+		const unsigned char *row = ref_pixels + (y - block_radius + wy)*ref_stride + base - block_radius;
+		int wx = 0;
+		for (; wx < 2 * block_radius; wx += 2, i += 2) {
+			__m256 ref_even = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(row + wx))));
+			__m256 ref_odd = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(row + wx + 1))));
+			dot_even = _mm256_add_ps(dot_even, _mm256_mul_ps(_mm256_set1_ps(src_unit[i]), ref_even));
+			dot_odd = _mm256_add_ps(dot_odd, _mm256_mul_ps(_mm256_set1_ps(src_unit[i + 1]), ref_odd));
+		}
+		__m256 ref_last = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(row + wx))));
+		dot_even = _mm256_add_ps(dot_even, _mm256_mul_ps(_mm256_set1_ps(src_unit[i]), ref_last));
+		i++;
+
+		__m256 dot = _mm256_add_ps(dot_even, dot_odd);
+		__m256 bound = _mm256_add_ps(_mm256_mul_ps(_mm256_add_ps(dot, _mm256_mul_ps(means, _mm256_set1_ps(rest_sums[wy]))), inv_deviations),
+									 _mm256_set1_ps(rest_norms[wy]));
+		if (_mm256_movemask_ps(_mm256_cmp_ps(bound, floor, _CMP_GE_OQ)) == 0) {
+			return false;
+		}
+	}
+	scores = _mm256_mul_ps(_mm256_add_ps(dot_even, dot_odd), inv_deviations);
+	return true;
+}
+#elif ZNCC_SIMD_LANES == 4
+inline bool descriptor_group_scores_pruned(const float *src_unit, const unsigned char *ref_pixels, int ref_stride,
+										   int x, int y, int block_radius, const float *ref_row_mean, const float *ref_row_inv_deviation,
+										   int disparity, const float *rest_sums, const float *rest_norms, float prune_below,
+										   __m128 &scores)
+{
+	int base = x - disparity - 3; // reference column of lane 0
+	__m128 means = _mm_loadu_ps(ref_row_mean + base);
+	__m128 inv_deviations = _mm_loadu_ps(ref_row_inv_deviation + base);
+	__m128 floor = _mm_set1_ps(prune_below);
+	__m128 dot = _mm_setzero_ps();
+	int i = 0;
+	for (int wy = 0; wy <= 2 * block_radius; wy++) {
+		const unsigned char *row = ref_pixels + (y - block_radius + wy)*ref_stride + base - block_radius;
+		for (int wx = 0; wx <= 2 * block_radius; wx++, i++) {
+			int packed;
+			memcpy(&packed, row + wx, sizeof(packed));
+			__m128 ref_vals = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed)));
+			dot = _mm_add_ps(dot, _mm_mul_ps(_mm_set1_ps(src_unit[i]), ref_vals));
+		}
+
+		__m128 bound = _mm_add_ps(_mm_mul_ps(_mm_add_ps(dot, _mm_mul_ps(means, _mm_set1_ps(rest_sums[wy]))), inv_deviations),
+								  _mm_set1_ps(rest_norms[wy]));
+		if (_mm_movemask_ps(_mm_cmpge_ps(bound, floor)) == 0) {
+			return false;
+		}
+	}
+	scores = _mm_mul_ps(dot, inv_deviations);
+	return true;
+}
+#endif
+
+void calc_disparity_rows_pruned(GreyscaleImage &src_img, const WindowDescriptors &src_descriptors,
+								GreyscaleImage &ref_img, const WindowDescriptors &ref_descriptors,
+								int min_disp, int max_disp, int block_radius, int x_begin, int y_begin,
+								const DisparityView &tile, uint64_t &num_candidates, uint64_t &num_pruned)
+{
+	int width = src_img.width;
+	int height = src_img.height;
+	int x_end = x_begin + tile.width, y_end = y_begin + tile.height;
+	int window_width = 2 * block_radius + 1;
+	float src_unit[MAX_BLOCK_SIZE * MAX_BLOCK_SIZE];
+	float rest_sums[MAX_BLOCK_SIZE];	// sum of the unit window over rows k+1..2r
+	float rest_norms[MAX_BLOCK_SIZE];	// norm of the unit window over rows k+1..2r
+
+	for (int y = y_begin; y < y_end; y++) {
+		unsigned char *tile_row = tile.row(y - y_begin) - x_begin;
+		if (y - block_radius < 0 || y + block_radius >= height) {
+			memset(tile_row + x_begin, 0, tile.width);
+			continue;
+		}
+		const float *ref_row_mean = ref_descriptors.mean.row(y);
+		const float *ref_row_inv_deviation = ref_descriptors.inv_deviation.row(y);
+		int seed_disp = min_disp;
+
+		for (int x = x_begin; x < x_end; x++) {
+			int last_disp;
+			if (x - block_radius < 0 || x + block_radius >= width ||
+				!get_disparity_search_range(x, width, min_disp, max_disp, block_radius, last_disp)) {
+				tile_row[x] = 0;
+				continue;
+			}
+
+			fill_unit_window(src_img, src_descriptors, x, y, block_radius, src_unit);
+			float rest_sum = 0;
+			float rest_norm_sq = 0;
+			for (int wy = window_width - 1; wy >= 0; wy--) {
+				rest_sums[wy] = rest_sum;
+				rest_norms[wy] = sqrt(rest_norm_sq);
+				for (int wx = 0; wx < window_width; wx++) {
+					float value = src_unit[wy*window_width + wx];
+					rest_sum += value;
+					rest_norm_sq += value * value;
+				}
+			}
+
+			// Anything whose bound stays below the seed's score cannot be the best candidate
+			if (seed_disp > last_disp) {
+				seed_disp = min_disp;
+			}
+			float seed_zncc = descriptor_candidate(src_unit, get_window_view(ref_img, x - seed_disp, y, block_radius),
+												   ref_row_inv_deviation[x - seed_disp]);
+			float prune_below = seed_zncc - PRUNE_MARGIN;
+			num_candidates += last_disp - min_disp + 1;
+
+			float best_zncc = 0;
+			int best_disp = 0;
+			int disparity = min_disp;
+#if ZNCC_SIMD_LANES > 1
+			float lane_scores[ZNCC_SIMD_LANES];
+			for (; disparity + ZNCC_SIMD_LANES - 1 <= last_disp; disparity += ZNCC_SIMD_LANES) {
+#if ZNCC_SIMD_LANES == 8
+				__m256 scores;
+#else
+				__m128 scores;
+#endif
+				if (!descriptor_group_scores_pruned(src_unit, ref_img.row(0), ref_img.stride, x, y, block_radius,
+													ref_row_mean, ref_row_inv_deviation, disparity,
+													rest_sums, rest_norms, prune_below, scores)) {
+					num_pruned += ZNCC_SIMD_LANES;
+					continue;
+				}
+				// Lane k scores disparity + LANES-1 - k, so walk the lanes from the lowest disparity
+				store_group_scores(lane_scores, scores);
+				for (int k = ZNCC_SIMD_LANES - 1; k >= 0; k--) {
+					if (lane_scores[k] > best_zncc) {
+						best_zncc = lane_scores[k];
+						best_disp = disparity + ZNCC_SIMD_LANES - 1 - k;
+					}
+				}
+			}
+#endif
+			for (; disparity <= last_disp; disparity++) {
+				int offset = x - disparity;
+				WindowView ref_window = get_window_view(ref_img, offset, y, block_radius);
+				float dot = 0;
+				int i = 0;
+				bool pruned = false;
+				for (int wy = 0; wy < window_width && !pruned; wy++) {
+					const unsigned char *row = ref_window.row(wy);
+					for (int wx = 0; wx < window_width; wx++, i++) {
+						dot += src_unit[i] * row[wx];
+					}
+					pruned = descriptor_score_bound(dot, ref_row_mean[offset], ref_row_inv_deviation[offset],
+													rest_sums[wy], rest_norms[wy]) < prune_below;
+				}
+				if (pruned) {
+					num_pruned++;
+					continue;
+				}
+				float zncc = dot * ref_row_inv_deviation[offset];
+				if (zncc > best_zncc) {
+					best_zncc = zncc;
+					best_disp = disparity;
+				}
+			}
+			seed_disp = best_zncc > 0 ? best_disp : min_disp;
+			tile_row[x] = abs(best_disp);
+		}
+	}
+}
+
+// Writes into disparity_map like calc_disparity_map
+void calc_disparity_map_pruned(GreyscaleImage &src_img, WindowDescriptors &src_descriptors,
+							   GreyscaleImage &ref_img, WindowDescriptors &ref_descriptors,
+							   int min_disp, int max_disp, int block_radius, unsigned num_threads,
+							   int tile_width, int tile_height, uint64_t &num_candidates, uint64_t &num_pruned,
+							   DisparityMap &disparity_map)
+{
+	disparity_map.resize(src_img.width, src_img.height);
+	std::atomic<uint64_t> total_candidates(0), total_pruned(0);
+	run_tiles(disparity_map.view(), tile_width, tile_height, num_threads, [&](const DisparityView &tile, int x_begin, int y_begin) {
+		uint64_t candidates = 0, pruned = 0;
+		calc_disparity_rows_pruned(src_img, src_descriptors, ref_img, ref_descriptors, min_disp, max_disp, block_radius,
+								   x_begin, y_begin, tile, candidates, pruned);
+		total_candidates += candidates;
+		total_pruned += pruned;
+	});
+	num_candidates += total_candidates;
+	num_pruned += total_pruned;
+}
+
+void print_prune_report(uint64_t num_candidates, uint64_t num_pruned) {
+	std::cout << "Pruned " << num_pruned << " of " << num_candidates << " candidates ("
+			  << (num_candidates > 0 ? 100.0 * num_pruned / num_candidates : 0.0) << "%)" << std::endl;
+}
+
+/*
+	Descriptor scores of left window x against right window x - d, for d in [first_disp, last_disp].
+	costs[d] receives the score; this is one row of the L2R cost volume.
+*/
+void fill_descriptor_costs(const float *src_unit, const unsigned char *ref_pixels, int ref_stride, int x, int y, int block_radius,
+						   const float *ref_row_inv_deviation, int first_disp, int last_disp, float *costs)
+{
+	int disparity = first_disp;
+#if ZNCC_SIMD_LANES > 1
+	for (; disparity + ZNCC_SIMD_LANES - 1 <= last_disp; disparity += ZNCC_SIMD_LANES) {
+		float lane_scores[ZNCC_SIMD_LANES];
+		store_group_scores(lane_scores, descriptor_group_scores(src_unit, ref_pixels, ref_stride, x, y, block_radius,
+																ref_row_inv_deviation, disparity));
+		for (int k = 0; k < ZNCC_SIMD_LANES; k++) {
+			costs[disparity + ZNCC_SIMD_LANES - 1 - k] = lane_scores[k];
+		}
+	}
+#endif
+	for (; disparity <= last_disp; disparity++) {
+		costs[disparity] = descriptor_candidate(src_unit, get_window_view(ref_pixels, ref_stride, x - disparity, y, block_radius),
+												ref_row_inv_deviation[x - disparity]);
+	}
+}
+
+/*
+	Offset of the true score peak from best_disp, found by fitting a parabola through the
+	scores at best_disp - 1, best_disp and best_disp + 1. Returns 0 when a neighbour is
+	outside the searched range or the scores do not form a peak.
+*/
+inline float subpixel_offset(const float *costs, int best_disp, int first_disp, int last_disp) {
+	if (best_disp <= first_disp || best_disp >= last_disp) {
+		return 0;
+	}
+	float left = costs[best_disp - 1], center = costs[best_disp], right = costs[best_disp + 1];
+	float curvature = left - 2 * center + right;
+	if (curvature >= 0) {
+		return 0;
+	}
+	float offset = 0.5f * (left - right) / curvature;
+	return offset < -0.5f ? -0.5f : (offset > 0.5f ? 0.5f : offset);
+}
+
+/*
+	L2R descriptor search that also refines every disparity to sub-pixel precision.
+	Candidate scores of a pixel are kept in a small buffer while they are computed, so
+	the parabola fit needs no second pass. disparity_map receives the same integer
+	disparities as calc_disparity_map_descriptor, subpixel_map the refined ones in
+	fixed point with SUBPIXEL_BITS fractional bits. Both maps are written in rows
+	[y_begin, y_end).
+*/
+void calc_disparity_rows_subpixel(GreyscaleImage &src_img, const WindowDescriptors &src_descriptors,
+								  GreyscaleImage &ref_img, const WindowDescriptors &ref_descriptors,
+								  int min_disp, int max_disp, int block_radius, int y_begin, int y_end,
+								  DisparityMap &disparity_map, Image<uint16_t> &subpixel_map, float *costs)
+{
+	int width = src_img.width;
+	int height = src_img.height;
+	float src_unit[MAX_BLOCK_SIZE * MAX_BLOCK_SIZE];
+
+	for (int y = y_begin; y < y_end; y++) {
+		unsigned char *disparity_row = disparity_map.row(y);
+		uint16_t *subpixel_row = subpixel_map.row(y);
+		memset(disparity_row, 0, width);
+		memset(subpixel_row, 0, width * sizeof(uint16_t));
+		if (y - block_radius < 0 || y + block_radius >= height) {
+			continue;
+		}
+		for (int x = block_radius; x + block_radius < width; x++) {
+			int last_disp;
+			if (!get_disparity_search_range(x, width, min_disp, max_disp, block_radius, last_disp)) {
+				continue;
+			}
+			fill_unit_window(src_img, src_descriptors, x, y, block_radius, src_unit);
+			fill_descriptor_costs(src_unit, ref_img.row(0), ref_img.stride, x, y, block_radius,
+								  ref_descriptors.inv_deviation.row(y), min_disp, last_disp, costs);
+
+			float best_zncc = 0;
+			int best_disp = -1;
+			for (int disparity = min_disp; disparity <= last_disp; disparity++) {
+				if (costs[disparity] > best_zncc) {
+					best_zncc = costs[disparity];
+					best_disp = disparity;
+				}
+			}
+			if (best_disp < 0) {
+				continue;
+			}
+			float refined = best_disp + subpixel_offset(costs, best_disp, min_disp, last_disp);
+			disparity_row[x] = best_disp;
+			subpixel_row[x] = (uint16_t)lrintf(refined * (1 << SUBPIXEL_BITS));
+		}
+	}
+}
+
+// Both maps keep their storage between calls, scratch.costs holds one row of scores per thread
+void calc_disparity_map_subpixel(GreyscaleImage &src_img, WindowDescriptors &src_descriptors,
+								 GreyscaleImage &ref_img, WindowDescriptors &ref_descriptors,
+								 int min_disp, int max_disp, int block_radius, unsigned num_threads,
+								 SearchScratch &scratch, DisparityMap &disparity_map, Image<uint16_t> &subpixel_map)
+{
+	size_t costs_size = max_disp + 1;
+	scratch.costs.resize(costs_size * std::max(num_threads, 1u));
+	disparity_map.resize(src_img.width, src_img.height);
+	subpixel_map.resize(src_img.width, src_img.height);
+	run_worker_row_bands(src_img.height, num_threads, [&](unsigned worker, int y_begin, int y_end) {
+		calc_disparity_rows_subpixel(src_img, src_descriptors, ref_img, ref_descriptors, min_disp, max_disp, block_radius,
+									 y_begin, y_end, disparity_map, subpixel_map, &scratch.costs[worker * costs_size]);
+	});
+}
+
+/*
+	Computes both disparity maps from one cost volume. The L2R score of left pixel x at
+	disparity d compares the same two windows as the R2L score of right pixel x - d at
+	disparity -d, so each pair is scored once into a per-row slab costs[x][d] and both
+	maps are read from it with the candidate order and range of calc_disparity_map:
+	L2R searches [min_disp, max_disp] and R2L [-max_disp, -min_disp].
+*/
+void calc_disparity_rows_shared(GreyscaleImage &left_img, const WindowDescriptors &left_descriptors,
+								GreyscaleImage &right_img, const WindowDescriptors &right_descriptors,
+								int min_disp, int max_disp, int block_radius, int y_begin, int y_end,
+								DisparityMap &L2R_disparity_map, DisparityMap &R2L_disparity_map, float *costs)
+{
+	int width = left_img.width;
+	int height = left_img.height;
+	int num_disps = max_disp + 1;
+	float src_unit[MAX_BLOCK_SIZE * MAX_BLOCK_SIZE];
+
+	for (int y = y_begin; y < y_end; y++) {
+		unsigned char *L2R_row = L2R_disparity_map.row(y), *R2L_row = R2L_disparity_map.row(y);
+		memset(L2R_row, 0, width);
+		memset(R2L_row, 0, width);
+		if (y - block_radius < 0 || y + block_radius >= height) {
+			continue;
+		}
+		const float *right_row_inv_deviation = right_descriptors.inv_deviation.row(y);
+
+		// Score every windowable (x, d) pair once and pick the L2R disparity
+		for (int x = block_radius; x + block_radius < width; x++) {
+			int last_disp;
+			if (!get_disparity_search_range(x, width, min_disp, max_disp, block_radius, last_disp)) {
+				continue;
+			}
+			float *pixel_costs = &costs[x*num_disps];
+			fill_unit_window(left_img, left_descriptors, x, y, block_radius, src_unit);
+			fill_descriptor_costs(src_unit, right_img.row(0), right_img.stride, x, y, block_radius,
+								  right_row_inv_deviation, min_disp, last_disp, pixel_costs);
+
+			float best_zncc = 0;
+			for (int disparity = min_disp; disparity <= last_disp; disparity++) {
+				if (pixel_costs[disparity] > best_zncc) {
+					best_zncc = pixel_costs[disparity];
+					L2R_row[x] = disparity;
+				}
+			}
+		}
+
+		// R2L candidates run from -max_disp to -min_disp, i.e. d from max_disp down to min_disp
+		for (int x = block_radius; x + block_radius < width; x++) {
+			int last_disp;
+			if (!get_disparity_search_range(x, width, -max_disp, -min_disp, block_radius, last_disp)) {
+				continue;
+			}
+			float best_zncc = 0;
+			for (int disparity = max_disp; disparity >= -last_disp; disparity--) {
+				float zncc = costs[(x + disparity)*num_disps + disparity];
+				if (zncc > best_zncc) {
+					best_zncc = zncc;
+					R2L_row[x] = disparity;
+				}
+			}
+		}
+	}
+}
+
+// Both maps keep their storage between calls, scratch.costs holds one slab per thread
+void calc_disparity_maps_shared(GreyscaleImage &left_img, WindowDescriptors &left_descriptors,
+								GreyscaleImage &right_img, WindowDescriptors &right_descriptors,
+								int min_disp, int max_disp, int block_radius, unsigned num_threads,
+								SearchScratch &scratch, DisparityMap &L2R_disparity_map, DisparityMap &R2L_disparity_map)
+{
+	size_t costs_size = (size_t)left_img.width * (max_disp + 1);
+	scratch.costs.resize(costs_size * std::max(num_threads, 1u));
+	L2R_disparity_map.resize(left_img.width, left_img.height);
+	R2L_disparity_map.resize(left_img.width, left_img.height);
+	run_worker_row_bands(left_img.height, num_threads, [&](unsigned worker, int y_begin, int y_end) {
+		calc_disparity_rows_shared(left_img, left_descriptors, right_img, right_descriptors, min_disp, max_disp, block_radius,
+								   y_begin, y_end, L2R_disparity_map, R2L_disparity_map, &scratch.costs[worker * costs_size]);
+	});
+}
+
+#define NO_SCORE (-2.0f) // below every ZNCC score, never selected
+
+// Round-to-nearest-even float to IEEE half conversion
+inline uint16_t float_to_half(float value) {
+#if defined(__F16C__)
+	return _cvtss_sh(value, 0);
+#else
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	uint32_t sign = (bits >> 16) & 0x8000;
+	int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+	uint32_t mantissa = bits & 0x7fffff;
+	if (exponent >= 31) {
+		return (uint16_t)(sign | 0x7c00 | (((bits >> 23) & 0xff) == 0xff && mantissa ? 0x200 : 0));
+	}
+	if (exponent <= 0) {
+		if (exponent < -10) return (uint16_t)sign;
+		mantissa |= 0x800000;
+		int shift = 14 - exponent;
+		uint32_t half_mantissa = mantissa >> shift;
+		uint32_t remainder = mantissa & ((1u << shift) - 1);
+		uint32_t halfway = 1u << (shift - 1);
+		if (remainder > halfway || (remainder == halfway && (half_mantissa & 1))) half_mantissa++;
+		return (uint16_t)(sign | half_mantissa);
+	}
+	uint32_t half = sign | (exponent << 10) | (mantissa >> 13);
+	uint32_t remainder = mantissa & 0x1fff;
+	if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1))) half++; // may carry into the exponent
+	return (uint16_t)half;
+#endif
+}
+
+inline float half_to_float(uint16_t half) {
+#if defined(__F16C__)
+	return _cvtsh_ss(half);
+#else
+	uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+	uint32_t exponent = (half >> 10) & 0x1f;
+	uint32_t mantissa = half & 0x3ff;
+	uint32_t bits;
+	if (exponent == 0x1f) {
+		bits = sign | 0x7f800000 | (mantissa << 13);
+	}
+	else if (exponent != 0) {
+		bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+	}
+	else if (mantissa == 0) {
+		bits = sign;
+	}
+	else {
+		// Subnormal half, normalise the mantissa
+		exponent = 127 - 15 + 1;
+		while (!(mantissa & 0x400)) {
+			mantissa <<= 1;
+			exponent--;
+		}
+		bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+	}
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+#endif
+}
+
+/*
+	W x H x D matching scores stored in 16 bits per entry, so later stages can reuse the
+	scores without recomputing them. Scores are ZNCC values in [-1, 1]; entries that were
+	never set read back as NO_SCORE. The default 735x504x66 volume takes 46 MB and a
+	full-resolution 2940x2016x261 one 2.9 GB. resize keeps the storage when it is already
+	large enough, so a volume held across frames is allocated once.
+*/
+struct CostVolume {
+
+	unsigned width = 0, height = 0;
+	int min_disp = 0, max_disp = -1;
+	CostStorage storage = COST_INT16;
+	CostLayout layout = COST_PIXEL_MAJOR;
+	size_t x_stride = 0, y_stride = 0, disp_stride = 0;
+	vector<uint16_t> data;
+
+	CostVolume() {}
+
+	CostVolume(unsigned width, unsigned height, int min_disp, int max_disp, CostStorage storage, CostLayout layout) {
+		resize(width, height, min_disp, max_disp, storage, layout);
+	}
+
+	// Reshapes the volume and resets every entry to NO_SCORE
+	void resize(unsigned new_width, unsigned new_height, int new_min_disp, int new_max_disp, CostStorage new_storage, CostLayout new_layout) {
+		width = new_width;
+		height = new_height;
+		min_disp = new_min_disp;
+		max_disp = new_max_disp;
+		storage = new_storage;
+		layout = new_layout;
+		size_t num_disps = max_disp - min_disp + 1;
+		if (layout == COST_PIXEL_MAJOR) {
+			disp_stride = 1;
+			x_stride = num_disps;
+			y_stride = num_disps * width;
+		}
+		else {
+			x_stride = 1;
+			y_stride = width;
+			disp_stride = (size_t)width * height;
+		}
+		data.assign(num_disps * width * height, encode(NO_SCORE));
+	}
+
+	size_t index(unsigned x, unsigned y, int disparity) const {
+		return y*y_stride + x*x_stride + (disparity - min_disp)*disp_stride;
+	}
+
+	uint16_t encode(float score) const {
+		if (storage == COST_FP16) {
+			return float_to_half(score);
+		}
+		if (score == NO_SCORE) {
+			return (uint16_t)INT16_MIN;
+		}
+		float clamped = score > 1.0f ? 1.0f : (score < -1.0f ? -1.0f : score);
+		return (uint16_t)(int16_t)lrintf(clamped * 32767.0f);
+	}
+
+	float decode(uint16_t value) const {
+		if (storage == COST_FP16) {
+			return half_to_float(value);
+		}
+		if ((int16_t)value == INT16_MIN) {
+			return NO_SCORE;
+		}
+		return (int16_t)value / 32767.0f;
+	}
+
+	float get(unsigned x, unsigned y, int disparity) const {
+		return decode(data[index(x, y, disparity)]);
+	}
+
+	void set(unsigned x, unsigned y, int disparity, float score) {
+		data[index(x, y, disparity)] = encode(score);
+	}
+
+	size_t size_in_bytes() const {
+		return data.size() * sizeof(uint16_t);
+	}
+};
+
+/*
+	Fills an L2R cost volume (left pixel x against right pixel x - d, d in [volume.min_disp,
+	volume.max_disp]) with descriptor ZNCC scores. Candidates outside calc_disparity_map's search range
+	are left at NO_SCORE.
+*/
+void calc_cost_volume(GreyscaleImage &left_img, WindowDescriptors &left_descriptors,
+					  GreyscaleImage &right_img, WindowDescriptors &right_descriptors,
+					  int block_radius, unsigned num_threads, SearchScratch &scratch, CostVolume &volume)
+{
+	int width = left_img.width;
+	int height = left_img.height;
+	size_t costs_size = volume.max_disp + 1;
+	scratch.costs.resize(costs_size * std::max(num_threads, 1u));
+	run_worker_row_bands(height, num_threads, [&](unsigned worker, int y_begin, int y_end) {
+		float src_unit[MAX_BLOCK_SIZE * MAX_BLOCK_SIZE];
+		float *costs = &scratch.costs[worker * costs_size];
+		int first_y = y_begin > block_radius ? y_begin : block_radius;
+		int last_y = y_end < height - block_radius ? y_end : height - block_radius;
+		for (int y = first_y; y < last_y; y++) {
+			for (int x = block_radius; x + block_radius < width; x++) {
+				int last_disp;
+				if (!get_disparity_search_range(x, width, volume.min_disp, volume.max_disp, block_radius, last_disp)) {
+					continue;
+				}
+				fill_unit_window(left_img, left_descriptors, x, y, block_radius, src_unit);
+				fill_descriptor_costs(src_unit, right_img.row(0), right_img.stride, x, y, block_radius,
+									  right_descriptors.inv_deviation.row(y), volume.min_disp, last_disp, costs);
+				for (int disparity = volume.min_disp; disparity <= last_disp; disparity++) {
+					volume.set(x, y, disparity, costs[disparity]);
+				}
+			}
+		}
+	});
+}
+
+/*
+	Winner-take-all on an L2R cost volume. L2R disparities are read along d for each left
+	pixel, R2L disparities along the diagonal (x + d, d) for each right pixel, in the
+	candidate order of calc_disparity_map so ties resolve the same way.
+*/
+void extract_disparity_maps(const CostVolume &volume, int block_radius, unsigned num_threads,
+							DisparityMap &L2R_disparity_map, DisparityMap &R2L_disparity_map)
+{
+	int width = volume.width;
+	int min_disp = volume.min_disp, max_disp = volume.max_disp;
+	L2R_disparity_map.assign(volume.width, volume.height, 0);
+	R2L_disparity_map.assign(volume.width, volume.height, 0);
+	run_row_bands(volume.height, num_threads, [&](int y_begin, int y_end) {
+		for (int y = y_begin; y < y_end; y++) {
+			unsigned char *L2R_row = L2R_disparity_map.row(y), *R2L_row = R2L_disparity_map.row(y);
+			for (int x = 0; x < width; x++) {
+				int last_disp;
+				float best_zncc = 0;
+				if (get_disparity_search_range(x, width, min_disp, max_disp, block_radius, last_disp)) {
+					for (int disparity = min_disp; disparity <= last_disp; disparity++) {
+						float zncc = volume.get(x, y, disparity);
+						if (zncc > best_zncc) {
+							best_zncc = zncc;
+							L2R_row[x] = disparity;
+						}
+					}
+				}
+				best_zncc = 0;
+				if (get_disparity_search_range(x, width, -max_disp, -min_disp, block_radius, last_disp)) {
+					for (int disparity = max_disp; disparity >= -last_disp; disparity--) {
+						float zncc = volume.get(x + disparity, y, disparity);
+						if (zncc > best_zncc) {
+							best_zncc = zncc;
+							R2L_row[x] = disparity;
+						}
+					}
+				}
+			}
+		}
+	});
+}
+
+// Half-size image, each pixel the rounded mean of a 2x2 box; half keeps its storage between calls
+void downsample_by_two(GreyscaleImage &image, GreyscaleImage &half) {
+	half.resize(image.width / 2, image.height / 2);
+	for (unsigned y = 0; y < half.height; y++) {
+		const unsigned char *row_0 = image.row(2 * y);
+		const unsigned char *row_1 = image.row(2 * y + 1);
+		unsigned char *half_row = half.row(y);
+		for (unsigned x = 0; x < half.width; x++) {
+			half_row[x] = (row_0[2 * x] + row_0[2 * x + 1] + row_1[2 * x] + row_1[2 * x + 1] + 2) / 4;
+		}
+	}
+}
+
+/*
+	Descriptor search restricted to a band around a guide disparity from the next coarser
+	pyramid level. guide holds that level's disparity map (absolute values, as written by
+	calc_disparity_map); the candidate range of pixel (x, y) becomes
+	sign * 2 * guide(x / 2, y / 2) +- band, clipped to [min_disp, max_disp] and to the
+	columns the reference window can reach. Pixels with guide 0 (border or no match at
+	the coarse level) fall back to the full range.
+*/
+void calc_disparity_rows_guided(GreyscaleImage &src_img, const WindowDescriptors &src_descriptors,
+								GreyscaleImage &ref_img, const WindowDescriptors &ref_descriptors,
+								const DisparityMap &guide, int min_disp, int max_disp, int band, int block_radius,
+								int y_begin, int y_end, DisparityMap &disparity_map)
+{
+	int width = src_img.width;
+	int height = src_img.height;
+	int sign = min_disp < 0 ? -1 : 1;
+	float src_unit[MAX_BLOCK_SIZE * MAX_BLOCK_SIZE];
+
+	for (int y = y_begin; y < y_end; y++) {
+		unsigned char *disparity_row = disparity_map.row(y);
+		memset(disparity_row, 0, width);
+		if (y - block_radius < 0 || y + block_radius >= height) {
+			continue;
+		}
+		const float *ref_row_inv_deviation = ref_descriptors.inv_deviation.row(y);
+		unsigned guide_y = (unsigned)y / 2 < guide.height ? y / 2 : guide.height - 1;
+		const unsigned char *guide_row = guide.row(guide_y);
+
+		for (int x = block_radius; x + block_radius < width; x++) {
+			unsigned guide_x = (unsigned)x / 2 < guide.width ? x / 2 : guide.width - 1;
+			int center = sign * 2 * guide_row[guide_x];
+			int first_disp = min_disp, last_disp = max_disp;
+			if (center != 0) {
+				first_disp = center - band > min_disp ? center - band : min_disp;
+				last_disp = center + band < max_disp ? center + band : max_disp;
+			}
+			// Keep the reference window inside the image
+			if (first_disp < x + block_radius + 1 - width) first_disp = x + block_radius + 1 - width;
+			if (last_disp > x - block_radius) last_disp = x - block_radius;
+
+			fill_unit_window(src_img, src_descriptors, x, y, block_radius, src_unit);
+			float best_zncc = 0;
+			int best_disp = 0;
+			int disparity = first_disp;
+#if ZNCC_SIMD_LANES > 1
+			disparity = search_descriptor_groups(src_unit, ref_img.row(0), ref_img.stride, x, y, block_radius,
+												 ref_row_inv_deviation, first_disp, last_disp, best_zncc, best_disp);
+#endif
+			for (; disparity <= last_disp; disparity++) {
+				float zncc = descriptor_candidate(src_unit, get_window_view(ref_img, x - disparity, y, block_radius),
+												  ref_row_inv_deviation[x - disparity]);
+				if (zncc > best_zncc) {
+					best_zncc = zncc;
+					best_disp = disparity;
+				}
+			}
+			disparity_row[x] = abs(best_disp);
+		}
+	}
+}
+
+/*
+	Planes of the levels above level 0 of calc_disparity_maps_pyramid, kept between frames:
+	index i holds level i + 1. The guides hold the maps of the level above the one being
+	searched and the level maps that level's result; the two are swapped after every level.
+*/
+struct PyramidBuffers {
+	vector<GreyscaleImage> left_levels, right_levels;
+	BoxSums box;
+	WindowDescriptors left_descriptors, right_descriptors;
+	DisparityMap L2R_guide, R2L_guide, L2R_level, R2L_level;
+};
+
+/*
+	Coarse-to-fine disparity search. The images are halved num_levels times with a 2x2 box
+	filter; the coarsest level searches its whole (scaled) disparity range and every finer
+	level only searches +-band around twice the disparity found one level up.
+	Level 0 is searched on the caller's images and descriptors, straight into the output maps.
+	Unlike calc_disparity_map, R2L pixels near the right border search the part of the range
+	that stays inside the image.
+*/
+void calc_disparity_maps_pyramid(GreyscaleImage &left_img, WindowDescriptors &left_descriptors,
+								 GreyscaleImage &right_img, WindowDescriptors &right_descriptors,
+								 int min_disp, int max_disp, int block_radius, int num_levels, int band, unsigned num_threads,
+								 PyramidBuffers &pyramid, DisparityMap &L2R_disparity_map, DisparityMap &R2L_disparity_map)
+{
+	int top_level = 0;
+	unsigned level_width = left_img.width, level_height = left_img.height;
+	while (top_level < num_levels && level_width / 2 > (unsigned)(2 * block_radius) && level_height / 2 > (unsigned)(2 * block_radius)) {
+		level_width /= 2;
+		level_height /= 2;
+		top_level++;
+	}
+	if (pyramid.left_levels.size() < (size_t)top_level) {
+		pyramid.left_levels.resize(top_level);
+		pyramid.right_levels.resize(top_level);
+	}
+	for (int level = 1; level <= top_level; level++) {
+		downsample_by_two(level > 1 ? pyramid.left_levels[level - 2] : left_img, pyramid.left_levels[level - 1]);
+		downsample_by_two(level > 1 ? pyramid.right_levels[level - 2] : right_img, pyramid.right_levels[level - 1]);
+	}
+
+	L2R_disparity_map.resize(left_img.width, left_img.height);
+	R2L_disparity_map.resize(left_img.width, left_img.height);
+	for (int level = top_level; level >= 0; level--) {
+		GreyscaleImage &left = level > 0 ? pyramid.left_levels[level - 1] : left_img;
+		GreyscaleImage &right = level > 0 ? pyramid.right_levels[level - 1] : right_img;
+		int level_min_disp = min_disp >> level;
+		int level_max_disp = (max_disp + (1 << level) - 1) >> level;
+
+		// Levels 1 and up share one set of descriptor planes and box-sum scratch
+		if (level > 0) {
+			calc_window_descriptors(left, block_radius, num_threads, pyramid.box, pyramid.left_descriptors);
+			calc_window_descriptors(right, block_radius, num_threads, pyramid.box, pyramid.right_descriptors);
+		}
+		WindowDescriptors &left_desc = level > 0 ? pyramid.left_descriptors : left_descriptors;
+		WindowDescriptors &right_desc = level > 0 ? pyramid.right_descriptors : right_descriptors;
+
+		DisparityMap *guides[] = { &pyramid.L2R_guide, &pyramid.R2L_guide };
+		DisparityMap *level_maps[] = { &pyramid.L2R_level, &pyramid.R2L_level };
+		for (int i = 0; i < 2; i++) {
+			if (level == top_level) {
+				// An all-zero guide searches the full range
+				guides[i]->assign(left.width / 2, left.height / 2, 0);
+			}
+			if (level > 0) {
+				level_maps[i]->resize(left.width, left.height);
+			}
+		}
+		DisparityMap &L2R_level = level > 0 ? pyramid.L2R_level : L2R_disparity_map;
+		DisparityMap &R2L_level = level > 0 ? pyramid.R2L_level : R2L_disparity_map;
+		run_row_bands(left.height, num_threads, [&](int y_begin, int y_end) {
+			calc_disparity_rows_guided(left, left_desc, right, right_desc, pyramid.L2R_guide, level_min_disp, level_max_disp, band,
+									   block_radius, y_begin, y_end, L2R_level);
+			calc_disparity_rows_guided(right, right_desc, left, left_desc, pyramid.R2L_guide, -level_max_disp, -level_min_disp, band,
+									   block_radius, y_begin, y_end, R2L_level);
+		});
+		std::swap(pyramid.L2R_guide, pyramid.L2R_level);
+		std::swap(pyramid.R2L_guide, pyramid.R2L_level);
+	}
+}
+
+#define SGM_COST_MAX 1023 // matching cost of zncc = -1 and of missing scores
+
+// Disparity count of an SGM cost row, rounded up to whole 16-lane registers
+inline int sgm_padded_disps(int num_disps) {
+	return (num_disps + 15) & ~15;
+}
+
+/*
+	SGM matching costs of one row, read straight from an int16 pixel-major cost volume:
+	cost = 1023 * (1 - zncc) / 2. Padding disparities get SGM_COST_MAX.
+*/
+void sgm_row_costs(const CostVolume &volume, int y, int padded_disps, uint16_t *costs) {
+	int num_disps = volume.max_disp - volume.min_disp + 1;
+	for (unsigned x = 0; x < volume.width; x++) {
+		const int16_t *scores = (const int16_t *)&volume.data[volume.index(x, y, volume.min_disp)];
+		uint16_t *pixel_costs = costs + x*padded_disps;
+		for (int d = 0; d < num_disps; d++) {
+			pixel_costs[d] = (uint16_t)((32767 - scores[d]) >> 6);
+		}
+		for (int d = num_disps; d < padded_disps; d++) {
+			pixel_costs[d] = SGM_COST_MAX;
+		}
+	}
+}
+
+/*
+	One step along an SGM path:
+		L(p, d) = C(p, d) + min(L(q, d), L(q, d-1) + P1, L(q, d+1) + P1, min_k L(q, k) + P2) - min_k L(q, k)
+	where q is the previous pixel on the path. prev and path have a 0xffff guard entry at
+	[-1] and [padded_disps], so d-1 and d+1 need no bounds checks. The new path costs are
+	also added to sum. Returns min_k L(p, k).
+*/
+inline uint16_t sgm_path_step(const uint16_t *costs, const uint16_t *prev, uint16_t prev_min, int padded_disps,
+							  uint16_t p1, uint16_t p2, uint16_t *path, uint16_t *sum)
+{
+#if ZNCC_SIMD_LANES == 8
+	__m256i penalty_1 = _mm256_set1_epi16(p1);
+	__m256i jump = _mm256_adds_epu16(_mm256_set1_epi16(prev_min), _mm256_set1_epi16(p2));
+	__m256i minimum = _mm256_set1_epi16(prev_min);
+	__m256i new_min = _mm256_set1_epi16((short)0xffff);
+	for (int d = 0; d < padded_disps; d += 16) {
+		__m256i same = _mm256_loadu_si256((const __m256i *)(prev + d));
+		__m256i lower = _mm256_adds_epu16(_mm256_loadu_si256((const __m256i *)(prev + d - 1)), penalty_1);
+		__m256i upper = _mm256_adds_epu16(_mm256_loadu_si256((const __m256i *)(prev + d + 1)), penalty_1);
+		__m256i best = _mm256_min_epu16(_mm256_min_epu16(same, jump), _mm256_min_epu16(lower, upper));
+		__m256i value = _mm256_add_epi16(_mm256_loadu_si256((const __m256i *)(costs + d)), _mm256_sub_epi16(best, minimum));
+		_mm256_storeu_si256((__m256i *)(path + d), value);
+		_mm256_storeu_si256((__m256i *)(sum + d), _mm256_adds_epu16(_mm256_loadu_si256((const __m256i *)(sum + d)), value));
+		new_min = _mm256_min_epu16(new_min, value);
+	}
+	__m128i halves_min = _mm_min_epu16(_mm256_castsi256_si128(new_min), _mm256_extracti128_si256(new_min, 1));
+	return (uint16_t)_mm_cvtsi128_si32(_mm_minpos_epu16(halves_min));
+#elif ZNCC_SIMD_LANES == 4
+	__m128i penalty_1 = _mm_set1_epi16(p1);
+	__m128i jump = _mm_adds_epu16(_mm_set1_epi16(prev_min), _mm_set1_epi16(p2));
+	__m128i minimum = _mm_set1_epi16(prev_min);
+	__m128i new_min = _mm_set1_epi16((short)0xffff);
+	for (int d = 0; d < padded_disps; d += 8) {
+		__m128i same = _mm_loadu_si128((const __m128i *)(prev + d));
+		__m128i lower = _mm_adds_epu16(_mm_loadu_si128((const __m128i *)(prev + d - 1)), penalty_1);
+		__m128i upper = _mm_adds_epu16(_mm_loadu_si128((const __m128i *)(prev + d + 1)), penalty_1);
+		__m128i best = _mm_min_epu16(_mm_min_epu16(same, jump), _mm_min_epu16(lower, upper));
+		__m128i value = _mm_add_epi16(_mm_loadu_si128((const __m128i *)(costs + d)), _mm_sub_epi16(best, minimum));
+		_mm_storeu_si128((__m128i *)(path + d), value);
+		_mm_storeu_si128((__m128i *)(sum + d), _mm_adds_epu16(_mm_loadu_si128((const __m128i *)(sum + d)), value));
+		new_min = _mm_min_epu16(new_min, value);
+	}
+	return (uint16_t)_mm_cvtsi128_si32(_mm_minpos_epu16(new_min));
+#else
+	unsigned jump = prev_min + p2;
+	uint16_t new_min = 0xffff;
+	for (int d = 0; d < padded_disps; d++) {
+		unsigned best = prev[d] < jump ? prev[d] : jump;
+		if (prev[d - 1] + (unsigned)p1 < best) best = prev[d - 1] + p1;
+		if (prev[d + 1] + (unsigned)p1 < best) best = prev[d + 1] + p1;
+		uint16_t value = (uint16_t)(costs[d] + best - prev_min);
+		path[d] = value;
+		unsigned total = sum[d] + value;
+		sum[d] = total > 0xffff ? 0xffff : total;
+		if (value < new_min) new_min = value;
+	}
+	return new_min;
+#endif
+}
+
+/*
+	Planes of calc_disparity_maps_sgm, kept between frames: the aggregated costs of the
+	whole image, the matching costs of one row, the path costs and their minima of the
+	previous and current row for every direction, and the guarded row that paths start from.
+*/
+struct SgmBuffers {
+	vector<uint16_t> aggregated;
+	vector<uint16_t> costs;
+	vector<uint16_t> path_rows;
+	vector<uint16_t> path_mins;
+	vector<uint16_t> edge;
+};
+
+/*
+	One SGM sweep over the image, forward (top-left to bottom-right) or backward. In scan
+	order every path direction has its predecessor to the left or in the previous row:
+	(-1, 0), (0, -1), (-1, -1) and (1, -1). 4-path SGM uses the first two, 8-path all four;
+	the backward sweep covers the mirrored directions. Paths start at the image edge with
+	L = C. Path costs of the previous and current row are kept per direction, in the halves
+	of sgm.path_rows and sgm.path_mins selected by the parity of the row.
+*/
+void sgm_sweep(const CostVolume &volume, int num_paths, uint16_t p1, uint16_t p2, bool backward, SgmBuffers &sgm) {
+	const int predecessor_x[4] = { -1, 0, -1, 1 };
+	const int predecessor_y[4] = { 0, -1, -1, -1 };
+	int num_dirs = num_paths / 2;
+	int width = volume.width;
+	int height = volume.height;
+	int padded_disps = sgm_padded_disps(volume.max_disp - volume.min_disp + 1);
+	int stride = padded_disps + 2; // guard entries on both sides
+	size_t row_size = (size_t)width * stride;
+
+	sgm.costs.resize(width * padded_disps);
+	sgm.edge.assign(stride, 0);
+	sgm.edge[0] = sgm.edge[stride - 1] = 0xffff;
+	sgm.path_rows.assign(2 * num_dirs * row_size, 0xffff);
+	sgm.path_mins.assign(2 * num_dirs * width, 0);
+
+	for (int scan_y = 0; scan_y < height; scan_y++) {
+		int y = backward ? height - 1 - scan_y : scan_y;
+		uint16_t *cur_rows = &sgm.path_rows[(scan_y & 1) * num_dirs * row_size];
+		uint16_t *prev_rows = &sgm.path_rows[((scan_y + 1) & 1) * num_dirs * row_size];
+		uint16_t *cur_mins = &sgm.path_mins[(scan_y & 1) * num_dirs * width];
+		uint16_t *prev_mins = &sgm.path_mins[((scan_y + 1) & 1) * num_dirs * width];
+		sgm_row_costs(volume, y, padded_disps, sgm.costs.data());
+		for (int scan_x = 0; scan_x < width; scan_x++) {
+			int x = backward ? width - 1 - scan_x : scan_x;
+			for (int dir = 0; dir < num_dirs; dir++) {
+				int prev_x = scan_x + predecessor_x[dir];
+				bool on_edge = prev_x < 0 || prev_x >= width || (predecessor_y[dir] < 0 && scan_y == 0);
+				const uint16_t *prev = sgm.edge.data() + 1;
+				uint16_t prev_min = 0;
+				if (!on_edge) {
+					const uint16_t *rows = predecessor_y[dir] < 0 ? prev_rows : cur_rows;
+					const uint16_t *mins = predecessor_y[dir] < 0 ? prev_mins : cur_mins;
+					prev = &rows[dir * row_size + prev_x * stride + 1];
+					prev_min = mins[dir * width + prev_x];
+				}
+				cur_mins[dir * width + scan_x] = sgm_path_step(&sgm.costs[x * padded_disps], prev, prev_min, padded_disps, p1, p2,
+															   &cur_rows[dir * row_size + scan_x * stride + 1],
+															   &sgm.aggregated[((size_t)y * width + x) * padded_disps]);
+			}
+		}
+	}
+}
+
+/*
+	Semi-global matching on an int16, pixel-major L2R cost volume: costs are aggregated
+	along num_paths (4 or 8) directions with penalties p1 for one-step disparity changes
+	and p2 for larger jumps, then both maps take the minimum aggregated cost with the
+	candidate order and range of extract_disparity_maps. Path costs stay below
+	SGM_COST_MAX + p2, so 8 paths fit in 16 bits while p2 <= 7000.
+*/
+void calc_disparity_maps_sgm(const CostVolume &volume, int block_radius, int num_paths, int p1, int p2, unsigned num_threads,
+							 SgmBuffers &sgm, DisparityMap &L2R_disparity_map, DisparityMap &R2L_disparity_map)
+{
+	int width = volume.width;
+	int min_disp = volume.min_disp, max_disp = volume.max_disp;
+	int padded_disps = sgm_padded_disps(max_disp - min_disp + 1);
+	sgm.aggregated.assign((size_t)volume.width * volume.height * padded_disps, 0);
+	const vector<uint16_t> &aggregated = sgm.aggregated;
+
+	// The two sweeps add into the same sums, so they run one after the other
+	sgm_sweep(volume, num_paths, p1, p2, false, sgm);
+	sgm_sweep(volume, num_paths, p1, p2, true, sgm);
+
+	L2R_disparity_map.assign(volume.width, volume.height, 0);
+	R2L_disparity_map.assign(volume.width, volume.height, 0);
+	run_row_bands(volume.height, num_threads, [&](int y_begin, int y_end) {
+		for (int y = y_begin; y < y_end; y++) {
+			if (y - block_radius < 0 || y + block_radius >= (int)volume.height) {
+				continue;
+			}
+			const uint16_t *row = &aggregated[(size_t)y * width * padded_disps];
+			unsigned char *L2R_row = L2R_disparity_map.row(y), *R2L_row = R2L_disparity_map.row(y);
+			for (int x = block_radius; x + block_radius < width; x++) {
+				int last_disp;
+				unsigned best_cost = 0xffff;
+				if (get_disparity_search_range(x, width, min_disp, max_disp, block_radius, last_disp)) {
+					for (int disparity = min_disp; disparity <= last_disp; disparity++) {
+						if (row[x*padded_disps + disparity - min_disp] < best_cost) {
+							best_cost = row[x*padded_disps + disparity - min_disp];
+							L2R_row[x] = disparity;
+						}
+					}
+				}
+				best_cost = 0xffff;
+				if (get_disparity_search_range(x, width, -max_disp, -min_disp, block_radius, last_disp)) {
+					for (int disparity = max_disp; disparity >= -last_disp; disparity--) {
+						if (row[(x + disparity)*padded_disps + disparity - min_disp] < best_cost) {
+							best_cost = row[(x + disparity)*padded_disps + disparity - min_disp];
+							R2L_row[x] = disparity;
+						}
+					}
+				}
+			}
+		}
+	});
+}
+
+inline int popcount64(uint64_t value) {
+#if defined(__POPCNT__)
+	return (int)_mm_popcnt_u64(value);
+#else
+	value = value - ((value >> 1) & 0x5555555555555555ULL);
+	value = (value & 0x3333333333333333ULL) + ((value >> 2) & 0x3333333333333333ULL);
+	value = (value + (value >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (int)((value * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+/*
+	Census signatures: bit i of a pixel is set when the i-th sampled neighbour in its window
+	is darker than the pixel itself. Windows wider than 11x11 are sampled every step pixels
+	so that a signature always fits in two 64-bit words. Row y of bits holds the
+	words_per_pixel words of every pixel of image row y.
+*/
+struct CensusImage {
+	unsigned width, height;
+	int step;
+	int words_per_pixel;
+	Image<uint64_t> bits;
+};
+
+// Fills census, reusing its storage when it is already large enough
+void calc_census_image(GreyscaleImage &image, int block_radius, CensusImage &census) {
+	census.width = image.width;
+	census.height = image.height;
+	census.step = 1;
+	int samples_per_axis;
+	while (true) {
+		samples_per_axis = 2 * (block_radius / census.step) + 1;
+		if (samples_per_axis * samples_per_axis - 1 <= 128) break;
+		census.step++;
+	}
+	census.words_per_pixel = samples_per_axis * samples_per_axis - 1 <= 64 ? 1 : 2;
+	census.bits.assign(image.width * census.words_per_pixel, image.height, 0);
+
+	int sample_radius = (block_radius / census.step) * census.step;
+	for (int y = sample_radius; y + sample_radius < (int)image.height; y++) {
+		for (int x = sample_radius; x + sample_radius < (int)image.width; x++) {
+			unsigned char center = image.row(y)[x];
+			uint64_t *signature = census.bits.row(y) + x * census.words_per_pixel;
+			int bit = 0;
+			for (int dy = -sample_radius; dy <= sample_radius; dy += census.step) {
+				for (int dx = -sample_radius; dx <= sample_radius; dx += census.step) {
+					if (dx == 0 && dy == 0) {
+						continue;
+					}
+					if (image.row(y + dy)[x + dx] < center) {
+						signature[bit / 64] |= 1ULL << (bit % 64);
+					}
+					bit++;
+				}
+			}
+		}
+	}
+}
+
+/*
+	Census disparity search: the cost of a candidate is the Hamming distance between the
+	two signatures and the lowest cost wins, first candidate on ties. Candidate order and
+	range are those of calc_disparity_map.
+*/
+void calc_disparity_rows_census(const CensusImage &src_census, const CensusImage &ref_census,
+								int min_disp, int max_disp, int block_radius, int y_begin, int y_end, DisparityMap &disparity_map)
+{
+	int width = src_census.width;
+	int height = src_census.height;
+	int words = src_census.words_per_pixel;
+
+	for (int y = y_begin; y < y_end; y++) {
+		unsigned char *disparity_row = disparity_map.row(y);
+		memset(disparity_row, 0, width);
+		if (y - block_radius < 0 || y + block_radius >= height) {
+			continue;
+		}
+		const uint64_t *src_row = src_census.bits.row(y);
+		const uint64_t *ref_row = ref_census.bits.row(y);
+		for (int x = block_radius; x + block_radius < width; x++) {
+			int last_disp;
+			if (!get_disparity_search_range(x, width, min_disp, max_disp, block_radius, last_disp)) {
+				continue;
+			}
+			int best_cost = 129;
+			int best_disp = 0;
+			if (words == 1) {
+				uint64_t src_bits = src_row[x];
+				for (int disparity = min_disp; disparity <= last_disp; disparity++) {
+					int cost = popcount64(src_bits ^ ref_row[x - disparity]);
+					if (cost < best_cost) {
+						best_cost = cost;
+						best_disp = disparity;
+					}
+				}
+			}
+			else {
+				uint64_t src_lo = src_row[2 * x], src_hi = src_row[2 * x + 1];
+				for (int disparity = min_disp; disparity <= last_disp; disparity++) {
+					const uint64_t *ref_bits = &ref_row[2 * (x - disparity)];
+					int cost = popcount64(src_lo ^ ref_bits[0]) + popcount64(src_hi ^ ref_bits[1]);
+					if (cost < best_cost) {
+						best_cost = cost;
+						best_disp = disparity;
+					}
+				}
+			}
+			disparity_row[x] = abs(best_disp);
+		}
+	}
+}
+
+// Writes into disparity_map like calc_disparity_map
+void calc_disparity_map_census(CensusImage &src_census, CensusImage &ref_census,
+							   int min_disp, int max_disp, int block_radius, unsigned num_threads,
+							   DisparityMap &disparity_map)
+{
+	disparity_map.resize(src_census.width, src_census.height);
+	run_row_bands(src_census.height, num_threads, [&](int y_begin, int y_end) {
+		calc_disparity_rows_census(src_census, ref_census, min_disp, max_disp, block_radius, y_begin, y_end, disparity_map);
+	});
+}
+
+void cross_check(DisparityMap &left_image, DisparityMap &right_image, int threshold, DisparityMap &cross_checked_image) {
+	/*
+	instead of 
+	abs(Left[index] - Right[index])
+	DO THIS
+	abs(Left[index] - Right[index - Left[index]])
+	*/
+
+	cross_checked_image.resize(left_image.width, left_image.height);
+	for (unsigned y = 0; y < left_image.height; y++) {
+		const unsigned char *left_row = left_image.row(y), *right_row = right_image.row(y);
+		unsigned char *checked_row = cross_checked_image.row(y);
+		for (int x = 0; x < (int)left_image.width; x++) {
+			unsigned char disparity = left_row[x];
+			// Matches always lie inside the row; a map that says otherwise fails the check
+			bool consistent = disparity <= x && abs(disparity - right_row[x - disparity]) <= threshold;
+			checked_row[x] = consistent ? disparity : 0;
+		}
+	}
+}
+
+unsigned char get_nearest_nonzero_pixel(DisparityMap &image, unsigned target_x, unsigned target_y) {
+	
+	/*
+	[ t o p ] r
+	l # # # # i
+	e # # # # g
+	e # # # # h
+	f # # # # t
+	t [ b o t ] 
+	*/
+
+	// Rings past the image size hold no pixels, so an all-zero map gives 0 instead of looping forever
+	int max_radius = image.width > image.height ? image.width : image.height;
+	unsigned char sentinel = 0;
+	for (int radius = 1; radius <= max_radius; radius++) {
+		// right side
+		int x = radius;
+		for (int y = radius; y > -radius; y--) {
+			sentinel = image.get_pixel((target_x + x), (target_y + y));
+			if (sentinel) return sentinel;
+		}
+		// bottom
+		int y = -radius;
+		for (int x = radius; x > -radius; x--) {
+			sentinel = image.get_pixel((target_x + x), (target_y + y));
+			if (sentinel) return sentinel;
+		}
+		// left side
+		x = -radius;
+		for (int y = -radius; y < radius; y++) {
+			sentinel = image.get_pixel((target_x + x), (target_y + y));
+			if (sentinel) return sentinel;
+		}
+		// top
+		y = radius;
+		for (int x = -radius; x < radius; x++) {
+			sentinel = image.get_pixel((target_x + x), (target_y + y));
+			if (sentinel) return sentinel;
+		}
+	}
+	return 0;
+}
+
+void occlusion_filling(DisparityMap &image, int block_radius, DisparityMap &occl_filled_image) {
+	occl_filled_image.resize(image.width, image.height);
+
+	unsigned char pixel_val;
 	for (unsigned y = 0; y < image.height; y++) {
 		for (unsigned x = 0; x < image.width; x++) {
+			unsigned char &filled = occl_filled_image.row(y)[x];
 			// ignore pixels that are 0
-			if (x - block_radius < 0 || x + block_radius >= image.width ||
-				y - block_radius < 0 || y + block_radius >= image.height) {
-				occl_filled_image.pixels.push_back(0);
+			if (x < (unsigned)block_radius || x + block_radius >= image.width ||
+				y < (unsigned)block_radius || y + block_radius >= image.height) {
+				filled = 0;
 				continue;
 			}
-			pixel_val = image.get_pixel(x, y);
-			if (pixel_val) {
-				occl_filled_image.pixels.push_back(pixel_val);
+			pixel_val = image.get_pixel(x, y);
+			if (pixel_val) {
+				filled = pixel_val;
+			}
+			else {
+				filled = get_nearest_nonzero_pixel(image, x, y);
+			}
+		}
+	}
+}
+
+// normalised may be disp_map itself, every pixel only reads its own value
+void normalise_disparity_map(DisparityMap &disp_map, int max_disp, DisparityMap &normalised) {
+	int max_value = 255;
+	normalised.resize(disp_map.width, disp_map.height);
+	for (unsigned y = 0; y < disp_map.height; y++) {
+		for (unsigned x = 0; x < disp_map.width; x++) {
+			unsigned char val = disp_map.row(y)[x];
+			unsigned char normalized_val = (val * max_value) / max_disp;
+			normalised.row(y)[x] = normalized_val;
+		}
+	}
+}
+
+/*
+	Every intermediate plane of one frame, owned in one place. ensure_frame_buffers sizes
+	the common planes for the first frame and does nothing for later frames of the same
+	size. The engine-specific planes (descriptors, summed-area tables, census signatures,
+	the cost volume, the SGM and pyramid planes) and the per-thread scratch are sized by
+	the stage that fills them. Every stage writes into the storage it is given and keeps it,
+	so once the first frame has sized them, later frames of the same size and settings
+	allocate no planes or scratch with any engine but opencl.
+	Strips match in a FrameBuffers of strip size, so the frame itself only needs the
+	disparity maps and the cross-checked map (matching_planes = false); the strips path
+	fills and normalises into L2R_map once the cross check has consumed it.
+*/
+struct FrameBuffers {
+	unsigned width = 0, height = 0;
+	GreyscaleImage left, right;
+	DownscaleScratch downscale;		// scratch of preprocess_images
+	BoxSums box;					// scratch of calc_window_averages and calc_window_descriptors
+	WindowMeans left_means, right_means;
+	WindowDescriptors left_descriptors, right_descriptors;
+	IntegralImage left_integral, right_integral;
+	CensusImage left_census, right_census;
+	CostVolume cost_volume;
+	SearchScratch search;			// per-thread scratch of the disparity searches
+	SgmBuffers sgm;
+	PyramidBuffers pyramid;
+	DisparityMap L2R_map, R2L_map;
+	Image<uint16_t> subpixel_map;	// --subpixel L2R map in SUBPIXEL_BITS fixed point
+	DisparityMap checked, filled, normalised;
+};
+
+void ensure_frame_buffers(FrameBuffers &frame, unsigned width, unsigned height, bool matching_planes) {
+	if (frame.width == width && frame.height == height) {
+		return;
+	}
+	frame.width = width;
+	frame.height = height;
+	DisparityMap *map_planes[] = { &frame.L2R_map, &frame.R2L_map, &frame.checked, &frame.filled, &frame.normalised };
+	unsigned num_map_planes = matching_planes ? 5 : 3;
+	for (unsigned i = 0; i < num_map_planes; i++) {
+		map_planes[i]->assign(width, height, 0);
+	}
+	if (!matching_planes) {
+		return;
+	}
+	frame.left.resize(width, height);
+	frame.right.resize(width, height);
+	frame.left_means.assign(width, height, NO_MEAN);
+	frame.right_means.assign(width, height, NO_MEAN);
+	frame.box.sum.assign(width, height, 0);
+}
+
+/*
+	The fields of a Middlebury calib.txt that bound the disparity search. vmin and vmax are
+	the smallest and largest disparity in the scene, ndisp a conservative upper bound, all
+	at the resolution given by width and height.
+*/
+struct Calibration {
+	unsigned width = 0, height = 0;
+	int ndisp = 0;
+	double vmin = -1, vmax = -1;
+};
+
+// Reads the key=value lines of calib.txt, returns false if the file is missing or has no vmin/vmax
+bool load_calibration(const char *filename, Calibration &calib) {
+	std::ifstream file(filename);
+	if (!file) {
+		return false;
+	}
+	std::string line;
+	while (std::getline(file, line)) {
+		size_t separator = line.find('=');
+		if (separator == std::string::npos) {
+			continue;
+		}
+		std::string key = line.substr(0, separator);
+		const char *value = line.c_str() + separator + 1;
+		if (key == "width") calib.width = atoi(value);
+		else if (key == "height") calib.height = atoi(value);
+		else if (key == "ndisp") calib.ndisp = atoi(value);
+		else if (key == "vmin") calib.vmin = atof(value);
+		else if (key == "vmax") calib.vmax = atof(value);
+	}
+	return calib.vmin >= 0 && calib.vmax >= calib.vmin;
+}
+
+/*
+	Scales the calibrated range [vmin, vmax] down to an image scaled_width wide, rounding
+	outwards so that no disparity of the scene is lost.
+*/
+void calibrated_disparity_range(const Calibration &calib, unsigned input_width, unsigned scaled_width, int &min_disp, int &max_disp) {
+	double factor = (double)(calib.width > 0 ? calib.width : input_width) / scaled_width;
+	min_disp = (int)floor(calib.vmin / factor);
+	max_disp = (int)ceil(calib.vmax / factor);
+	if (max_disp > 255) {
+		max_disp = 255; // disparity maps hold one byte per pixel
+	}
+}
+
+Settings parse_settings(int argc, const char *argv[]) {
+	Settings settings;
+	int positional = 0;
+	bool full_res = false;
+	for (int i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		if (strncmp(arg, "--", 2) != 0) {
+			if (positional == 0) settings.left_filename = arg;
+			else if (positional == 1) settings.right_filename = arg;
+			positional++;
+		}
+		else if (strcmp(arg, "--engine=direct") == 0) {
+			settings.engine = ZNCC_DIRECT;
+		}
+		else if (strcmp(arg, "--engine=integral") == 0) {
+			settings.engine = ZNCC_INTEGRAL;
+		}
+		else if (strcmp(arg, "--engine=simd") == 0) {
+			settings.engine = ZNCC_SIMD;
+		}
+		else if (strcmp(arg, "--engine=descriptor") == 0) {
+			settings.engine = ZNCC_DESCRIPTOR;
+		}
+		else if (strcmp(arg, "--engine=census") == 0) {
+			settings.engine = CENSUS_HAMMING;
+		}
+		else if (strcmp(arg, "--engine=integer") == 0) {
+			settings.engine = ZNCC_INTEGER;
+		}
+		else if (strcmp(arg, "--engine=opencl") == 0) {
+#ifdef USE_OPENCL
+			settings.engine = ZNCC_OPENCL;
+#else
+			std::cout << "This build has no OpenCL support, compile with -DUSE_OPENCL and link with -lOpenCL" << std::endl;
+			exit(1);
+#endif
+		}
+		else if (strncmp(arg, "--cl-kernels=", 13) == 0) {
+			settings.opencl_kernel_filename = arg + 13;
+		}
+		else if (strcmp(arg, "--shared-volume") == 0) {
+			settings.shared_cost_volume = true;
+		}
+		else if (strcmp(arg, "--cost-volume=fp16") == 0 || strcmp(arg, "--cost-volume=int16") == 0) {
+			settings.store_cost_volume = true;
+			settings.cost_storage = strcmp(arg + 14, "fp16") == 0 ? COST_FP16 : COST_INT16;
+		}
+		else if (strcmp(arg, "--cost-layout=pixel") == 0) {
+			settings.cost_layout = COST_PIXEL_MAJOR;
+		}
+		else if (strcmp(arg, "--cost-layout=disparity") == 0) {
+			settings.cost_layout = COST_DISPARITY_MAJOR;
+		}
+		else if (strncmp(arg, "--pyramid=", 10) == 0) {
+			settings.pyramid_levels = atoi(arg + 10);
+		}
+		else if (strncmp(arg, "--pyramid-band=", 15) == 0) {
+			settings.pyramid_band = atoi(arg + 15);
+		}
+		else if (strcmp(arg, "--subpixel") == 0) {
+			settings.subpixel = true;
+		}
+		else if (strcmp(arg, "--sgm=4") == 0 || strcmp(arg, "--sgm=8") == 0) {
+			settings.sgm_paths = atoi(arg + 6);
+		}
+		else if (strncmp(arg, "--sgm-p1=", 9) == 0) {
+			settings.sgm_p1 = atoi(arg + 9);
+		}
+		else if (strncmp(arg, "--sgm-p2=", 9) == 0) {
+			settings.sgm_p2 = atoi(arg + 9);
+		}
+		else if (strncmp(arg, "--block-size=", 13) == 0) {
+			settings.block_size = atoi(arg + 13);
+		}
+		else if (strncmp(arg, "--max-disp=", 11) == 0) {
+			settings.max_disp = atoi(arg + 11);
+			settings.max_disp_given = true;
+		}
+		else if (strcmp(arg, "--calib") == 0) {
+			settings.calib_filename = "calib.txt";
+		}
+		else if (strncmp(arg, "--calib=", 8) == 0) {
+			settings.calib_filename = arg + 8;
+		}
+		else if (strcmp(arg, "--prune") == 0) {
+			settings.prune = true;
+		}
+		else if (strncmp(arg, "--tile=", 7) == 0) {
+			if (sscanf(arg + 7, "%dx%d", &settings.tile_width, &settings.tile_height) != 2 ||
+				settings.tile_width < 1 || settings.tile_height < 1) {
+				std::cout << "Tile size has to be given as WIDTHxHEIGHT, e.g. --tile=64x16" << std::endl;
+				exit(1);
+			}
+		}
+		else if (strcmp(arg, "--benchmark-tiles") == 0) {
+			settings.benchmark_tiles = true;
+		}
+		else if (strncmp(arg, "--downsample=", 13) == 0) {
+			settings.downsample = atof(arg + 13);
+		}
+		else if (strcmp(arg, "--downscale=point") == 0) {
+			settings.downscale_filter = DOWNSCALE_POINT;
+		}
+		else if (strcmp(arg, "--downscale=area") == 0) {
+			settings.downscale_filter = DOWNSCALE_AREA;
+		}
+		else if (strncmp(arg, "--strips=", 9) == 0) {
+			settings.strip_height = atoi(arg + 9);
+			if (settings.strip_height < 1) {
+				std::cout << "Strips need at least one row" << std::endl;
+				exit(1);
 			}
-			else {
-				occl_filled_image.pixels.push_back(get_nearest_nonzero_pixel(image, x, y));
+		}
+		else if (strcmp(arg, "--full-res") == 0) {
+			full_res = true;
+		}
+		else if (strcmp(arg, "--self-test") == 0) {
+			settings.self_test = true;
+		}
+		else if (strncmp(arg, "--threads=", 10) == 0) {
+			settings.num_threads = atoi(arg + 10);
+		}
+		else {
+			std::cout << "Unknown option " << arg << std::endl;
+			std::cout << "Usage: depthmap [im0.png] [im1.png] [--engine=direct|integral|simd|descriptor|census|integer|opencl] [--threads=N] [--block-size=N] [--max-disp=N]" << std::endl;
+			std::cout << "       [--calib[=calib.txt]] [--cl-kernels=" << OPENCL_KERNEL_FILE << "]" << std::endl;
+			std::cout << "       [--shared-volume]" << std::endl;
+			std::cout << "       [--cost-volume=fp16|int16] [--cost-layout=pixel|disparity]" << std::endl;
+			std::cout << "       [--pyramid=LEVELS] [--pyramid-band=N] [--subpixel]" << std::endl;
+			std::cout << "       [--sgm=4|8] [--sgm-p1=N] [--sgm-p2=N] [--prune]" << std::endl;
+			std::cout << "       [--tile=WxH] [--benchmark-tiles]" << std::endl;
+			std::cout << "       [--downsample=N] [--downscale=point|area] [--strips=ROWS] [--full-res]" << std::endl;
+			std::cout << "       depthmap --self-test [--threads=N] [--cl-kernels=depthmap_kernels.cl]" << std::endl;
+			exit(1);
+		}
+	}
+	if (full_res) {
+		// Match every pixel, strip by strip unless --strips chose the height
+		settings.downsample = 1;
+		if (settings.strip_height == 0) {
+			settings.strip_height = STRIP_HEIGHT;
+		}
+	}
+	if (settings.downsample < 1) {
+		std::cout << "Downsample factor has to be at least 1" << std::endl;
+		exit(1);
+	}
+	if (settings.downsample != floor(settings.downsample) && settings.downscale_filter != DOWNSCALE_AREA) {
+		std::cout << "Fractional downsample factors need --downscale=area" << std::endl;
+		exit(1);
+	}
+	if (settings.engine == ZNCC_OPENCL && settings.downscale_filter != DOWNSCALE_POINT) {
+		std::cout << "--engine=opencl only supports --downscale=point" << std::endl;
+		exit(1);
+	}
+	if (settings.block_size < 3 || settings.block_size % 2 == 0 || settings.block_size > MAX_BLOCK_SIZE) {
+		std::cout << "Block size has to be uneven and between 3 and " << MAX_BLOCK_SIZE << std::endl;
+		exit(1);
+	}
+	if (settings.max_disp < settings.downsample) {
+		std::cout << "Maximum disparity has to be at least the downsample factor " << settings.downsample << std::endl;
+		exit(1);
+	}
+	int descriptor_modes = settings.shared_cost_volume + settings.store_cost_volume + (settings.pyramid_levels > 0) +
+						   settings.subpixel + (settings.sgm_paths > 0);
+	if ((descriptor_modes > 0 || settings.prune) && settings.engine != ZNCC_DESCRIPTOR) {
+		std::cout << "--shared-volume, --cost-volume, --pyramid, --subpixel, --sgm and --prune require --engine=descriptor" << std::endl;
+		exit(1);
+	}
+	if (descriptor_modes + settings.prune > 1) {
+		std::cout << "--shared-volume, --cost-volume, --pyramid, --subpixel, --sgm and --prune cannot be combined" << std::endl;
+		exit(1);
+	}
+	bool tiled = settings.tile_width > 0 || settings.benchmark_tiles;
+	if (tiled && (descriptor_modes > 0 || (settings.engine != ZNCC_DIRECT && settings.engine != ZNCC_SIMD && settings.engine != ZNCC_DESCRIPTOR))) {
+		std::cout << "--tile and --benchmark-tiles need the direct, simd or plain descriptor engine" << std::endl;
+		exit(1);
+	}
+	if (settings.strip_height > 0 && (descriptor_modes > 0 || settings.benchmark_tiles || settings.engine == ZNCC_OPENCL)) {
+		std::cout << "--strips and --full-res cannot be combined with --shared-volume, --cost-volume, --pyramid, --subpixel, --sgm," << std::endl;
+		std::cout << "--benchmark-tiles or --engine=opencl" << std::endl;
+		exit(1);
+	}
+	if (settings.sgm_p1 < 0 || settings.sgm_p2 < settings.sgm_p1 || settings.sgm_p2 > 7000) {
+		std::cout << "SGM penalties need 0 <= p1 <= p2 <= 7000" << std::endl;
+		exit(1);
+	}
+	return settings;
+}
+
+#ifdef USE_OPENCL
+/*
+	OpenCL version of the pipeline: greyscale conversion, window means, both ZNCC passes,
+	cross check and occlusion filling run as the kernels of depthmap_kernels.cl.
+	Device buffers are created for the first frame and reused by every later frame of the
+	same size. Intermediate images stay on the device and only the filled map is read back.
+	The first device of the first platform that has one is used, so CPU-only runtimes such
+	as PoCL work as well as GPUs.
+*/
+struct OpenClPipeline {
+	cl_context context = nullptr;
+	cl_command_queue queue = nullptr;
+	cl_program program = nullptr;
+	cl_kernel greyscale, window_means, zncc_disparity, cross_check, occlusion_fill;
+	unsigned input_width = 0, input_height = 0, width = 0, height = 0;
+	cl_mem rgba = nullptr;	// input frame, used for the left and then the right image
+	cl_mem left_grey, right_grey, left_means, right_means;
+	cl_mem L2R_map, R2L_map, checked_map;
+};
+
+void check_cl(cl_int status, const char *what) {
+	if (status != CL_SUCCESS) {
+		std::cout << "OpenCL error " << status << " in " << what << std::endl;
+		exit(1);
+	}
+}
+
+template <typename T>
+void set_kernel_arg(cl_kernel kernel, cl_uint index, const T &value) {
+	check_cl(clSetKernelArg(kernel, index, sizeof(T), &value), "clSetKernelArg");
+}
+
+void init_opencl_pipeline(OpenClPipeline &cl, const char *kernel_filename) {
+	// ICD loaders without any installed platform fail here (CL_PLATFORM_NOT_FOUND_KHR)
+	cl_uint num_platforms = 0;
+	if (clGetPlatformIDs(0, nullptr, &num_platforms) != CL_SUCCESS) {
+		num_platforms = 0;
+	}
+	vector<cl_platform_id> platforms(num_platforms);
+	if (num_platforms > 0) {
+		check_cl(clGetPlatformIDs(num_platforms, platforms.data(), nullptr), "clGetPlatformIDs");
+	}
+	cl_device_id device = nullptr;
+	for (unsigned i = 0; i < num_platforms && !device; i++) {
+		cl_uint num_devices = 0;
+		if (clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, 1, &device, &num_devices) != CL_SUCCESS || num_devices == 0) {
+			device = nullptr;
+		}
+	}
+	if (!device) {
+		std::cout << "No OpenCL device found" << std::endl;
+		exit(1);
+	}
+	char device_name[256] = "";
+	clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(device_name) - 1, device_name, nullptr);
+	std::cout << "OpenCL device: " << device_name << std::endl;
+
+	cl_int status;
+	cl.context = clCreateContext(nullptr, 1, &device, nullptr, nullptr, &status);
+	check_cl(status, "clCreateContext");
+	cl.queue = clCreateCommandQueue(cl.context, device, 0, &status);
+	check_cl(status, "clCreateCommandQueue");
+
+	std::ifstream file(kernel_filename);
+	if (!file) {
+		std::cout << "Could not read OpenCL kernels from " << kernel_filename << std::endl;
+		exit(1);
+	}
+	std::string source((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	const char *source_text = source.c_str();
+	size_t source_length = source.size();
+	cl.program = clCreateProgramWithSource(cl.context, 1, &source_text, &source_length, &status);
+	check_cl(status, "clCreateProgramWithSource");
+	if (clBuildProgram(cl.program, 1, &device, "", nullptr, nullptr) != CL_SUCCESS) {
+		size_t log_size = 0;
+		clGetProgramBuildInfo(cl.program, device, CL_PROGRAM_BUILD_LOG, 0, nullptr, &log_size);
+		vector<char> log(log_size + 1, 0);
+		clGetProgramBuildInfo(cl.program, device, CL_PROGRAM_BUILD_LOG, log_size, log.data(), nullptr);
+		std::cout << "Building " << kernel_filename << " failed:" << std::endl << log.data() << std::endl;
+		exit(1);
+	}
+
+	cl.greyscale = clCreateKernel(cl.program, "greyscale", &status);
+	check_cl(status, "clCreateKernel(greyscale)");
+	cl.window_means = clCreateKernel(cl.program, "window_means", &status);
+	check_cl(status, "clCreateKernel(window_means)");
+	cl.zncc_disparity = clCreateKernel(cl.program, "zncc_disparity", &status);
+	check_cl(status, "clCreateKernel(zncc_disparity)");
+	cl.cross_check = clCreateKernel(cl.program, "cross_check", &status);
+	check_cl(status, "clCreateKernel(cross_check)");
+	cl.occlusion_fill = clCreateKernel(cl.program, "occlusion_fill", &status);
+	check_cl(status, "clCreateKernel(occlusion_fill)");
+}
+
+void release_opencl_buffers(OpenClPipeline &cl) {
+	if (!cl.rgba) {
+		return;
+	}
+	cl_mem buffers[] = { cl.rgba, cl.left_grey, cl.right_grey, cl.left_means, cl.right_means, cl.L2R_map, cl.R2L_map, cl.checked_map };
+	for (unsigned i = 0; i < sizeof(buffers) / sizeof(buffers[0]); i++) {
+		clReleaseMemObject(buffers[i]);
+	}
+	cl.rgba = nullptr;
+}
+
+// (Re)creates the device buffers unless the previous frame had the same dimensions
+void ensure_opencl_buffers(OpenClPipeline &cl, unsigned input_width, unsigned input_height, unsigned width, unsigned height) {
+	if (cl.rgba && cl.input_width == input_width && cl.input_height == input_height && cl.width == width && cl.height == height) {
+		return;
+	}
+	release_opencl_buffers(cl);
+	cl.input_width = input_width;
+	cl.input_height = input_height;
+	cl.width = width;
+	cl.height = height;
+
+	cl_int status;
+	size_t pixels = width * height;
+	cl.rgba = clCreateBuffer(cl.context, CL_MEM_READ_ONLY, BYTES_PER_PIXEL * input_width * input_height, nullptr, &status);
+	check_cl(status, "clCreateBuffer");
+	cl_mem *byte_planes[] = { &cl.left_grey, &cl.right_grey, &cl.L2R_map, &cl.R2L_map, &cl.checked_map };
+	for (unsigned i = 0; i < sizeof(byte_planes) / sizeof(byte_planes[0]); i++) {
+		*byte_planes[i] = clCreateBuffer(cl.context, CL_MEM_READ_WRITE, pixels, nullptr, &status);
+		check_cl(status, "clCreateBuffer");
+	}
+	cl.left_means = clCreateBuffer(cl.context, CL_MEM_READ_WRITE, pixels * sizeof(float), nullptr, &status);
+	check_cl(status, "clCreateBuffer");
+	cl.right_means = clCreateBuffer(cl.context, CL_MEM_READ_WRITE, pixels * sizeof(float), nullptr, &status);
+	check_cl(status, "clCreateBuffer");
+}
+
+void release_opencl_pipeline(OpenClPipeline &cl) {
+	release_opencl_buffers(cl);
+	cl_kernel kernels[] = { cl.greyscale, cl.window_means, cl.zncc_disparity, cl.cross_check, cl.occlusion_fill };
+	for (unsigned i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		clReleaseKernel(kernels[i]);
+	}
+	clReleaseProgram(cl.program);
+	clReleaseCommandQueue(cl.queue);
+	clReleaseContext(cl.context);
+}
+
+// Runs kernel over one work-item per pixel of the reduced image
+void enqueue_image_kernel(OpenClPipeline &cl, cl_kernel kernel, const char *name) {
+	size_t global_size[2] = { cl.width, cl.height };
+	check_cl(clEnqueueNDRangeKernel(cl.queue, kernel, 2, nullptr, global_size, nullptr, 0, nullptr, nullptr), name);
+}
+
+// Greyscale conversion of one RGBA frame into grey, through the shared input buffer
+void enqueue_greyscale(OpenClPipeline &cl, vector<unsigned char> &rgba, int downsample_factor, cl_mem grey) {
+	check_cl(clEnqueueWriteBuffer(cl.queue, cl.rgba, CL_TRUE, 0, rgba.size(), rgba.data(), 0, nullptr, nullptr), "clEnqueueWriteBuffer");
+	set_kernel_arg(cl.greyscale, 0, cl.rgba);
+	set_kernel_arg(cl.greyscale, 1, (cl_int)cl.input_width);
+	set_kernel_arg(cl.greyscale, 2, (cl_int)downsample_factor);
+	set_kernel_arg(cl.greyscale, 3, grey);
+	enqueue_image_kernel(cl, cl.greyscale, "greyscale");
+}
+
+void enqueue_window_means(OpenClPipeline &cl, cl_mem grey, int block_radius, cl_mem means) {
+	set_kernel_arg(cl.window_means, 0, grey);
+	set_kernel_arg(cl.window_means, 1, (cl_int)block_radius);
+	set_kernel_arg(cl.window_means, 2, means);
+	enqueue_image_kernel(cl, cl.window_means, "window_means");
+}
+
+void enqueue_zncc_disparity(OpenClPipeline &cl, cl_mem src, cl_mem src_means, cl_mem ref, cl_mem ref_means,
+							int min_disp, int max_disp, int block_radius, cl_mem disparity_map)
+{
+	set_kernel_arg(cl.zncc_disparity, 0, src);
+	set_kernel_arg(cl.zncc_disparity, 1, src_means);
+	set_kernel_arg(cl.zncc_disparity, 2, ref);
+	set_kernel_arg(cl.zncc_disparity, 3, ref_means);
+	set_kernel_arg(cl.zncc_disparity, 4, (cl_int)min_disp);
+	set_kernel_arg(cl.zncc_disparity, 5, (cl_int)max_disp);
+	set_kernel_arg(cl.zncc_disparity, 6, (cl_int)block_radius);
+	set_kernel_arg(cl.zncc_disparity, 7, disparity_map);
+	enqueue_image_kernel(cl, cl.zncc_disparity, "zncc_disparity");
+}
+
+/*
+	Cross-checked and occlusion-filled L2R map of one stereo pair, the same image the C++
+	path hands to normalise_disparity_map, read back into filled.
+*/
+void calc_depthmap_opencl(OpenClPipeline &cl, vector<unsigned char> &left_rgba, vector<unsigned char> &right_rgba,
+						  unsigned input_width, unsigned input_height, int downsample_factor,
+						  int min_disp, int max_disp, int block_radius, DisparityMap &filled)
+{
+	ensure_opencl_buffers(cl, input_width, input_height, input_width / downsample_factor, input_height / downsample_factor);
+
+	enqueue_greyscale(cl, left_rgba, downsample_factor, cl.left_grey);
+	enqueue_greyscale(cl, right_rgba, downsample_factor, cl.right_grey);
+	enqueue_window_means(cl, cl.left_grey, block_radius, cl.left_means);
+	enqueue_window_means(cl, cl.right_grey, block_radius, cl.right_means);
+	enqueue_zncc_disparity(cl, cl.left_grey, cl.left_means, cl.right_grey, cl.right_means, min_disp, max_disp, block_radius, cl.L2R_map);
+	enqueue_zncc_disparity(cl, cl.right_grey, cl.right_means, cl.left_grey, cl.left_means, -max_disp, -min_disp, block_radius, cl.R2L_map);
+
+	set_kernel_arg(cl.cross_check, 0, cl.L2R_map);
+	set_kernel_arg(cl.cross_check, 1, cl.R2L_map);
+	set_kernel_arg(cl.cross_check, 2, (cl_int)10);
+	set_kernel_arg(cl.cross_check, 3, cl.checked_map);
+	enqueue_image_kernel(cl, cl.cross_check, "cross_check");
+
+	// The L2R buffer is free again once the cross check has run
+	set_kernel_arg(cl.occlusion_fill, 0, cl.checked_map);
+	set_kernel_arg(cl.occlusion_fill, 1, (cl_int)block_radius);
+	set_kernel_arg(cl.occlusion_fill, 2, cl.L2R_map);
+	enqueue_image_kernel(cl, cl.occlusion_fill, "occlusion_fill");
+
+	// The device map is packed, the host rows are padded to filled.stride
+	filled.resize(cl.width, cl.height);
+	size_t origin[3] = { 0, 0, 0 }, region[3] = { cl.width, cl.height, 1 };
+	check_cl(clEnqueueReadBufferRect(cl.queue, cl.L2R_map, CL_TRUE, origin, origin, region, cl.width, 0, filled.stride, 0,
+									 filled.row(0), 0, nullptr, nullptr),
+			 "clEnqueueReadBufferRect");
+}
+#endif
+
+/*
+	Hardware cache-miss counters of this thread and the threads it starts later, read through
+	perf_event_open on Linux. L1 data cache read misses show how often the reference rows had
+	to come from L2 or further, last-level misses how often they came from memory. Counting
+	starts when the counters are opened. Without permission or a PMU (most VMs,
+	perf_event_paranoid > 2) opening fails and the benchmark reports times and working sets only.
+*/
+struct CacheMissCounters {
+	int l1d_fd = -1;
+	int llc_fd = -1;
+};
+
+#ifdef __linux__
+int open_perf_counter(uint32_t type, uint64_t config) {
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.inherit = 1;	// count the worker threads started after opening too, added to the total when they exit
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+bool open_cache_miss_counters(CacheMissCounters &counters) {
+#ifdef __linux__
+	counters.l1d_fd = open_perf_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+															(PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+	counters.llc_fd = open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+#endif
+	return counters.l1d_fd >= 0 || counters.llc_fd >= 0;
+}
+
+// Count of one counter since it was opened, -1 if it is not available
+int64_t read_cache_miss_counter(int fd) {
+	int64_t count = -1;
+#ifdef __linux__
+	uint64_t value;
+	if (fd >= 0 && read(fd, &value, sizeof(value)) == (ssize_t)sizeof(value)) {
+		count = (int64_t)value;
+	}
+#endif
+	return count;
+}
+
+void close_cache_miss_counters(CacheMissCounters &counters) {
+#ifdef __linux__
+	if (counters.l1d_fd >= 0) close(counters.l1d_fd);
+	if (counters.llc_fd >= 0) close(counters.llc_fd);
+#endif
+	counters.l1d_fd = counters.llc_fd = -1;
+}
+
+// Pixels that differ between two maps, every pixel when the sizes differ
+unsigned count_differences(const DisparityMap &a, const DisparityMap &b) {
+	if (a.width != b.width || a.height != b.height) {
+		return std::max(a.width * a.height, b.width * b.height);
+	}
+	unsigned differences = 0;
+	for (unsigned y = 0; y < a.height; y++) {
+		for (unsigned x = 0; x < a.width; x++) {
+			differences += a.row(y)[x] != b.row(y)[x];
+		}
+	}
+	return differences;
+}
+
+/*
+	Times the L2R search of the selected engine with full-row traversal and with a range of
+	tile sizes (plus --tile, if given), printing the working set of each next to its time
+	and, where the hardware counters can be read, the cache misses of the search.
+	A working set that fits in L2 means the reference rows are still cached when the next
+	row of the tile reuses them. Every tiled map is checked against the full-row map, and
+	the fastest traversal is printed last as the --tile value to use on this machine.
+*/
+void benchmark_tiles(Settings &settings, GreyscaleImage &left, GreyscaleImage &right, int min_disp, int max_disp, int block_radius) {
+	BoxSums box;
+	WindowMeans left_means, right_means;
+	WindowDescriptors left_descriptors, right_descriptors;
+	if (settings.engine == ZNCC_DESCRIPTOR) {
+		calc_window_descriptors(left, block_radius, settings.num_threads, box, left_descriptors);
+		calc_window_descriptors(right, block_radius, settings.num_threads, box, right_descriptors);
+	}
+	else {
+		calc_window_averages(left, block_radius, settings.num_threads, box, left_means);
+		calc_window_averages(right, block_radius, settings.num_threads, box, right_means);
+	}
+
+	vector<int> tile_sizes = { 0, 0, 16, 16, 32, 16, 64, 16, 64, 32, 128, 32, 256, 64 };
+	if (settings.tile_width > 0) {
+		tile_sizes.push_back(settings.tile_width);
+		tile_sizes.push_back(settings.tile_height);
+	}
+	DisparityMap disparity_map, full_rows_map;
+	size_t fastest = 0;
+	double fastest_seconds = 0.0;
+	for (size_t i = 0; i < tile_sizes.size(); i += 2) {
+		int tile_width = tile_sizes[i], tile_height = tile_sizes[i + 1];
+		// Pool threads started before the counters would not be counted
+		worker_pool.stop();
+		CacheMissCounters counters;
+		if (!open_cache_miss_counters(counters) && i == 0) {
+			std::cout << "Cache-miss counters unavailable (no perf_event_open access), reporting times only" << std::endl;
+		}
+		auto start = std::chrono::steady_clock::now();
+		uint64_t num_candidates = 0, num_pruned = 0;
+		if (settings.prune) {
+			calc_disparity_map_pruned(left, left_descriptors, right, right_descriptors, min_disp, max_disp, block_radius,
+									  settings.num_threads, tile_width, tile_height, num_candidates, num_pruned, disparity_map);
+		}
+		else if (settings.engine == ZNCC_DESCRIPTOR) {
+			calc_disparity_map_descriptor(left, left_descriptors, right, right_descriptors, min_disp, max_disp, block_radius,
+										  settings.num_threads, tile_width, tile_height, disparity_map);
+		}
+		else if (settings.engine == ZNCC_SIMD) {
+			calc_disparity_map_simd(left, left_means, right, right_means, min_disp, max_disp, block_radius,
+									settings.num_threads, tile_width, tile_height, disparity_map);
+		}
+		else {
+			calc_disparity_map(left, left_means, right, right_means, min_disp, max_disp, block_radius,
+							   settings.num_threads, tile_width, tile_height, disparity_map);
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		worker_pool.stop();
+		int64_t l1d_misses = read_cache_miss_counter(counters.l1d_fd);
+		int64_t llc_misses = read_cache_miss_counter(counters.llc_fd);
+		close_cache_miss_counters(counters);
+		if (i == 0 || seconds < fastest_seconds) {
+			fastest = i;
+			fastest_seconds = seconds;
+		}
+
+		size_t working_set;
+		if (tile_width > 0) {
+			std::cout << tile_width << "x" << tile_height << " tiles: ";
+			working_set = tile_working_set(tile_width, tile_height, block_radius, max_disp - min_disp + 1);
+		}
+		else {
+			std::cout << "full rows: ";
+			working_set = tile_working_set(left.width, 1, block_radius, max_disp - min_disp + 1);
+			full_rows_map = disparity_map;
+		}
+		std::cout << "working set " << working_set / 1024 << " KB, " << seconds * 1000 << " ms";
+		if (l1d_misses >= 0) std::cout << ", " << l1d_misses / 1000 << "k L1D read misses";
+		if (llc_misses >= 0) std::cout << ", " << llc_misses / 1000 << "k LLC misses";
+		if (count_differences(disparity_map, full_rows_map) > 0) {
+			std::cout << " (map differs from full rows!)";
+		}
+		std::cout << std::endl;
+		if (settings.prune) {
+			std::cout << "  ";
+			print_prune_report(num_candidates, num_pruned);
+		}
+	}
+	if (tile_sizes[fastest] > 0) {
+		std::cout << "Fastest: --tile=" << tile_sizes[fastest] << "x" << tile_sizes[fastest + 1] << std::endl;
+	}
+	else {
+		std::cout << "Fastest: full rows, tiling does not pay off here" << std::endl;
+	}
+}
+
+/*
+	Both disparity maps of one strip with the per-pixel engines, from the greyscale planes
+	in strip.left and strip.right into strip.L2R_map and strip.R2L_map. Every engine only
+	reads the rows within block_radius of a pixel, so the rows that have their full halo
+	inside the strip come out exactly as if the whole image had been matched.
+	With --prune the candidate and pruned counts of the strip are added to num_candidates
+	and num_pruned.
+*/
+void calc_disparity_maps_strip(Settings &settings, FrameBuffers &strip, int min_disp, int max_disp, int block_radius,
+							   uint64_t &num_candidates, uint64_t &num_pruned) {
+	GreyscaleImage &left = strip.left, &right = strip.right;
+	DisparityMap &L2R_disparity_map = strip.L2R_map, &R2L_disparity_map = strip.R2L_map;
+	if (settings.engine == ZNCC_INTEGRAL || settings.engine == ZNCC_INTEGER) {
+		IntegralImage &left_integral = strip.left_integral, &right_integral = strip.right_integral;
+		calc_integral_image(left, left_integral);
+		calc_integral_image(right, right_integral);
+		if (settings.engine == ZNCC_INTEGER) {
+			calc_disparity_map_integer(left, left_integral, right, right_integral, min_disp, max_disp, block_radius, settings.num_threads,
+									   strip.search, L2R_disparity_map);
+			calc_disparity_map_integer(right, right_integral, left, left_integral, -max_disp, -min_disp, block_radius, settings.num_threads,
+									   strip.search, R2L_disparity_map);
+		}
+		else {
+			calc_disparity_map_integral(left, left_integral, right, right_integral, min_disp, max_disp, block_radius, settings.num_threads,
+										strip.search, L2R_disparity_map);
+			calc_disparity_map_integral(right, right_integral, left, left_integral, -max_disp, -min_disp, block_radius, settings.num_threads,
+										strip.search, R2L_disparity_map);
+		}
+	}
+	else if (settings.engine == CENSUS_HAMMING) {
+		CensusImage &left_census = strip.left_census, &right_census = strip.right_census;
+		calc_census_image(left, block_radius, left_census);
+		calc_census_image(right, block_radius, right_census);
+		calc_disparity_map_census(left_census, right_census, min_disp, max_disp, block_radius, settings.num_threads, L2R_disparity_map);
+		calc_disparity_map_census(right_census, left_census, -max_disp, -min_disp, block_radius, settings.num_threads, R2L_disparity_map);
+	}
+	else if (settings.engine == ZNCC_DESCRIPTOR) {
+		WindowDescriptors &left_descriptors = strip.left_descriptors, &right_descriptors = strip.right_descriptors;
+		calc_window_descriptors(left, block_radius, settings.num_threads, strip.box, left_descriptors);
+		calc_window_descriptors(right, block_radius, settings.num_threads, strip.box, right_descriptors);
+		if (settings.prune) {
+			calc_disparity_map_pruned(left, left_descriptors, right, right_descriptors, min_disp, max_disp, block_radius, settings.num_threads,
+									  settings.tile_width, settings.tile_height, num_candidates, num_pruned, L2R_disparity_map);
+			calc_disparity_map_pruned(right, right_descriptors, left, left_descriptors, -max_disp, -min_disp, block_radius, settings.num_threads,
+									  settings.tile_width, settings.tile_height, num_candidates, num_pruned, R2L_disparity_map);
+		}
+		else {
+			calc_disparity_map_descriptor(left, left_descriptors, right, right_descriptors, min_disp, max_disp, block_radius, settings.num_threads,
+										  settings.tile_width, settings.tile_height, L2R_disparity_map);
+			calc_disparity_map_descriptor(right, right_descriptors, left, left_descriptors, -max_disp, -min_disp, block_radius, settings.num_threads,
+										  settings.tile_width, settings.tile_height, R2L_disparity_map);
+		}
+	}
+	else {
+		calc_window_averages(left, block_radius, settings.num_threads, strip.box, strip.left_means);
+		calc_window_averages(right, block_radius, settings.num_threads, strip.box, strip.right_means);
+		if (settings.engine == ZNCC_SIMD) {
+			calc_disparity_map_simd(left, strip.left_means, right, strip.right_means, min_disp, max_disp, block_radius, settings.num_threads,
+									settings.tile_width, settings.tile_height, L2R_disparity_map);
+			calc_disparity_map_simd(right, strip.right_means, left, strip.left_means, -max_disp, -min_disp, block_radius, settings.num_threads,
+									settings.tile_width, settings.tile_height, R2L_disparity_map);
+		}
+		else {
+			calc_disparity_map(left, strip.left_means, right, strip.right_means, min_disp, max_disp, block_radius, settings.num_threads,
+							   settings.tile_width, settings.tile_height, L2R_disparity_map);
+			calc_disparity_map(right, strip.right_means, left, strip.left_means, -max_disp, -min_disp, block_radius, settings.num_threads,
+							   settings.tile_width, settings.tile_height, R2L_disparity_map);
+		}
+	}
+}
+
+/*
+	Matches the reduced image strip by strip, straight from the RGBA inputs, into
+	frame.L2R_map and frame.R2L_map. Each strip of settings.strip_height rows is converted to
+	greyscale together with block_radius halo rows above and below it, matched, and only its
+	own rows are copied, view to view, into the full maps. Peak memory of the matching is therefore set by
+	the strip height and the image width, not by the image height; only the inputs and the
+	frame planes are whole images. The strip planes live in strip, are sized by the first
+	strip and reused by every later strip and frame. The --prune counts are summed over all
+	strips; halo rows are never searched, so they add up to the counts of an unstripped run.
+*/
+void calc_disparity_maps_strips(Settings &settings, const RgbaView &left_img, const RgbaView &right_img,
+								int min_disp, int max_disp, int block_radius, FrameBuffers &frame, FrameBuffers &strip,
+								uint64_t &num_candidates, uint64_t &num_pruned) {
+	unsigned width = frame.width, height = frame.height;
+	ensure_frame_buffers(strip, width, std::min(settings.strip_height + 2 * block_radius, (int)height), true);
+	for (unsigned y_begin = 0; y_begin < height; y_begin += settings.strip_height) {
+		unsigned y_end = std::min(y_begin + settings.strip_height, height);
+		unsigned halo_begin = y_begin > (unsigned)block_radius ? y_begin - block_radius : 0;
+		unsigned halo_end = std::min(y_end + block_radius, height);
+
+		strip.left.resize(width, halo_end - halo_begin);
+		preprocess_images(left_img, right_img, settings.downsample, settings.downscale_filter, halo_begin, settings.num_threads,
+						  strip.downscale, strip.left, strip.right);
+		calc_disparity_maps_strip(settings, strip, min_disp, max_disp, block_radius, num_candidates, num_pruned);
+
+		unsigned own_rows = y_end - y_begin;
+		copy_pixels(strip.L2R_map.view(0, y_begin - halo_begin, width, own_rows), frame.L2R_map.view(0, y_begin, width, own_rows));
+		copy_pixels(strip.R2L_map.view(0, y_begin - halo_begin, width, own_rows), frame.R2L_map.view(0, y_begin, width, own_rows));
+	}
+}
+
+/*
+	Synthetic stereo pair for --self-test: smoothed noise in the left image, and the right
+	image sees it shifted by a disparity that grows down the image in bands of 16 rows, with
+	a little noise of its own. Fixed seed, so every run matches the same pair.
+*/
+void make_test_pair(unsigned width, unsigned height, GreyscaleImage &left, GreyscaleImage &right) {
+	uint32_t seed = 12345;
+	vector<unsigned char> noise(width * height);
+	for (unsigned i = 0; i < noise.size(); i++) {
+		seed = seed * 1664525 + 1013904223;
+		noise[i] = seed >> 24;
+	}
+	left.resize(width, height);
+	right.resize(width, height);
+	for (unsigned y = 0; y < height; y++) {
+		for (unsigned x = 0; x < width; x++) {
+			unsigned sum = 0;
+			for (unsigned dy = 0; dy < 3; dy++) {
+				for (unsigned dx = 0; dx < 3; dx++) {
+					sum += noise[std::min(y + dy, height - 1) * width + std::min(x + dx, width - 1)];
+				}
 			}
+			left.row(y)[x] = sum / 9;
+		}
+	}
+	for (unsigned y = 0; y < height; y++) {
+		unsigned disparity = 4 + 3 * (y / 16);
+		for (unsigned x = 0; x < width; x++) {
+			seed = seed * 1664525 + 1013904223;
+			int value = left.row(y)[x + disparity < width ? x + disparity : width - 1] + (int)(seed >> 30) - 2;
+			right.row(y)[x] = value < 0 ? 0 : value > 255 ? 255 : value;
 		}
 	}
-	return occl_filled_image;
 }
 
-GreyscaleImage normalise_disparity_map(GreyscaleImage &disp_map, int max_disp) {
-	int max_value = 255;
-	GreyscaleImage normalised;
-	normalised.height = disp_map.height;
-	normalised.width  = disp_map.width;
-	normalised.pixels = vector<unsigned char>();
-	for (vector<unsigned char>::iterator it = disp_map.pixels.begin(); it != disp_map.pixels.end(); ++it) {
-		unsigned char val = *it;
-		unsigned char normalized_val = (val * max_value) / max_disp;
-		normalised.pixels.push_back(normalized_val);
+// Pixels in which two maps differ
+
+// The simd engine has to choose exactly the disparities of the direct engine
+bool self_test_simd(unsigned num_threads) {
+	GreyscaleImage left, right;
+	make_test_pair(96, 64, left, right);
+	const int block_sizes[] = { 3, 5, 7, 9, 15, 25 };
+	const int tiles[][2] = { { 0, 0 }, { 24, 8 } };
+	const int ranges[][2] = { { 0, 23 }, { 5, 16 } };
+	bool passed = true;
+	BoxSums box;
+	WindowMeans left_means, right_means;
+	DisparityMap direct_map, simd_map;
+	for (int block_size : block_sizes) {
+		int block_radius = (block_size - 1) / 2;
+		calc_window_averages(left, block_radius, num_threads, box, left_means);
+		calc_window_averages(right, block_radius, num_threads, box, right_means);
+		unsigned differences = 0;
+		for (const int *tile : tiles) {
+			for (const int *range : ranges) {
+				calc_disparity_map(left, left_means, right, right_means, range[0], range[1], block_radius, num_threads, tile[0], tile[1], direct_map);
+				calc_disparity_map_simd(left, left_means, right, right_means, range[0], range[1], block_radius, num_threads, tile[0], tile[1], simd_map);
+				differences += count_differences(direct_map, simd_map);
+				calc_disparity_map(right, right_means, left, left_means, -range[1], -range[0], block_radius, num_threads, tile[0], tile[1], direct_map);
+				calc_disparity_map_simd(right, right_means, left, left_means, -range[1], -range[0], block_radius, num_threads, tile[0], tile[1], simd_map);
+				differences += count_differences(direct_map, simd_map);
+			}
+		}
+		std::cout << "simd vs direct, block size " << block_size << ": " << (differences ? "FAILED, " : "ok, ")
+				  << differences << " differing pixels" << std::endl;
+		passed = passed && differences == 0;
 	}
-	return normalised;
+	return passed;
 }
 
-int main(int argc, const char *argv[]) {
-	
-	const char* filename_1 = argc > 1 ? argv[1] : "im0.png";
-	const char* filename_2 = argc > 2 ? argv[2] : "im1.png";
+/*
+	Fixed-point greyscale against the float formula it replaces, over all 2^24 RGB colours:
+	no colour may be more than one level off, and the SIMD row conversion has to agree with
+	greyscale_value.
+*/
+bool self_test_greyscale() {
+	vector<unsigned char> row(BYTES_PER_PIXEL * 256, 255);
+	unsigned char output_row[256];
+	unsigned num_off_by_one = 0, num_wrong = 0;
+	for (int r = 0; r < 256; r++) {
+		for (int g = 0; g < 256; g++) {
+			for (int b = 0; b < 256; b++) {
+				unsigned char *pixel = &row[BYTES_PER_PIXEL * b];
+				pixel[0] = r, pixel[1] = g, pixel[2] = b;
+			}
+			downscale_greyscale_row(row.data(), 1, 256, output_row);
+			for (int b = 0; b < 256; b++) {
+				int float_grey = (int)(0.2126f * r + 0.7152f * g + 0.0722f * b);
+				int fixed_grey = output_row[b];
+				if (fixed_grey != greyscale_value(&row[BYTES_PER_PIXEL * b]) || abs(fixed_grey - float_grey) > 1) {
+					num_wrong++;
+				}
+				else if (fixed_grey != float_grey) {
+					num_off_by_one++;
+				}
+			}
+		}
+	}
+	std::cout << "greyscale vs float: " << (num_wrong ? "FAILED, " : "ok, ") << num_off_by_one << " of " << (1 << 24)
+			  << " colours one level off";
+	if (num_wrong) std::cout << ", " << num_wrong << " wrong";
+	std::cout << std::endl;
+	return num_wrong == 0;
+}
 
-	// Read im0 to memory
-	unsigned int L_img_width, L_img_height;
-	vector<unsigned char> left_img = vector<unsigned char>();
-	decodeFile(filename_1, left_img, L_img_width, L_img_height);
+#ifdef USE_OPENCL
+/*
+	The OpenCL pipeline has to produce the filled map of the direct engine. The test pair is
+	coloured and stored at twice its size, so the greyscale kernel's weights and point
+	sampling are compared with preprocess_images as well.
+*/
+bool self_test_opencl(Settings &settings) {
+	GreyscaleImage left_test, right_test;
+	make_test_pair(96, 64, left_test, right_test);
+	const unsigned factor = 2;
+	unsigned width = left_test.width, height = left_test.height;
+	unsigned input_width = width * factor, input_height = height * factor;
+	vector<unsigned char> left_rgba(BYTES_PER_PIXEL * input_width * input_height, 255);
+	vector<unsigned char> right_rgba(left_rgba.size(), 255);
+	for (unsigned y = 0; y < input_height; y++) {
+		for (unsigned x = 0; x < input_width; x++) {
+			unsigned char left_value = left_test.row(y / factor)[x / factor];
+			unsigned char right_value = right_test.row(y / factor)[x / factor];
+			unsigned char *left_pixel = &left_rgba[BYTES_PER_PIXEL * (y*input_width + x)];
+			unsigned char *right_pixel = &right_rgba[BYTES_PER_PIXEL * (y*input_width + x)];
+			left_pixel[0] = left_value, left_pixel[1] = 255 - left_value, left_pixel[2] = left_value * 3;
+			right_pixel[0] = right_value, right_pixel[1] = 255 - right_value, right_pixel[2] = right_value * 3;
+		}
+	}
+	GreyscaleImage left(width, height), right(width, height);
+	DownscaleScratch downscale;
+	preprocess_images(rgba_view(left_rgba, input_width, input_height), rgba_view(right_rgba, input_width, input_height),
+					  factor, DOWNSCALE_POINT, 0, settings.num_threads, downscale, left, right);
+
+	OpenClPipeline cl;
+	init_opencl_pipeline(cl, settings.opencl_kernel_filename);
+	const int block_sizes[] = { 5, 9, 15 };
+	const int ranges[][2] = { { 0, 23 }, { 5, 16 } };
+	bool passed = true;
+	BoxSums box;
+	WindowMeans left_means, right_means;
+	DisparityMap L2R_map, R2L_map, checked, filled, cl_filled;
+	for (int block_size : block_sizes) {
+		int block_radius = (block_size - 1) / 2;
+		calc_window_averages(left, block_radius, settings.num_threads, box, left_means);
+		calc_window_averages(right, block_radius, settings.num_threads, box, right_means);
+		unsigned differences = 0;
+		for (const int *range : ranges) {
+			calc_disparity_map(left, left_means, right, right_means, range[0], range[1], block_radius, settings.num_threads, 0, 0, L2R_map);
+			calc_disparity_map(right, right_means, left, left_means, -range[1], -range[0], block_radius, settings.num_threads, 0, 0, R2L_map);
+			cross_check(L2R_map, R2L_map, 10, checked);
+			occlusion_filling(checked, block_radius, filled);
+			calc_depthmap_opencl(cl, left_rgba, right_rgba, input_width, input_height, factor,
+								 range[0], range[1], block_radius, cl_filled);
+			differences += count_differences(filled, cl_filled);
+		}
+		std::cout << "opencl vs direct, block size " << block_size << ": " << (differences ? "FAILED, " : "ok, ")
+				  << differences << " differing pixels" << std::endl;
+		passed = passed && differences == 0;
+	}
+	release_opencl_pipeline(cl);
+	return passed;
+}
+#endif
+
+// --self-test: checks the engines against each other on synthetic input, exit status 1 on a mismatch
+int run_self_test(Settings &settings) {
+	std::cout << "Self test with " << ZNCC_SIMD_LANES << " SIMD lanes, " << settings.num_threads << " threads" << std::endl;
+	bool passed = self_test_greyscale();
+	passed = self_test_simd(settings.num_threads) && passed;
+#ifdef USE_OPENCL
+	passed = self_test_opencl(settings) && passed;
+#endif
+	std::cout << (passed ? "All checks passed" : "Self test FAILED") << std::endl;
+	return passed ? 0 : 1;
+}
+
+int main(int argc, const char *argv[]) {
 	
-	if (L_img_width != INPUT_IMG_WIDTH || L_img_height != INPUT_IMG_HEIGHT) {
-		std::cout << "Expected input image with dimensions " << INPUT_IMG_WIDTH << " x " << INPUT_IMG_HEIGHT << 
-					 ". Instead got " << L_img_width << " x " << L_img_height << std::endl;
-		exit(1);
+	Settings settings = parse_settings(argc, argv);
+	if (settings.self_test) {
+		return run_self_test(settings);
 	}
+	const char* filename_1 = settings.left_filename;
+	const char* filename_2 = settings.right_filename;
 
-	// Read im1 to memory
-	unsigned int R_img_width, R_img_height;
+	// Read im0 and im1 to memory, im1 on a second thread
+	unsigned int L_img_width = 0, L_img_height = 0;
+	unsigned int R_img_width = 0, R_img_height = 0;
+	vector<unsigned char> left_img = vector<unsigned char>();
 	vector<unsigned char> right_img = vector<unsigned char>();
-	decodeFile(filename_2, right_img, R_img_width, R_img_height);
+	if (settings.num_threads > 1) {
+		std::thread right_decoder([&]() { decodeFile(filename_2, right_img, R_img_width, R_img_height); });
+		decodeFile(filename_1, left_img, L_img_width, L_img_height);
+		right_decoder.join();
+	}
+	else {
+		decodeFile(filename_1, left_img, L_img_width, L_img_height);
+		decodeFile(filename_2, right_img, R_img_width, R_img_height);
+	}
 	
 	if (L_img_width != R_img_width || L_img_height != R_img_height) {
 		std::cout << "Images have to be the same size! Exiting..." << std::endl;
@@ -341,78 +4009,285 @@ int main(int argc, const char *argv[]) {
 	unsigned int width = L_img_width;
 	unsigned int height = L_img_height;
 	
-	unsigned int scaled_width = width / 4;
-	unsigned int scaled_height = height / 4;
+	unsigned int scaled_width = (unsigned)(width / settings.downsample);
+	unsigned int scaled_height = (unsigned)(height / settings.downsample);
+
+	int block_radius = (settings.block_size - 1) / 2;
+	if (scaled_width <= 2 * (unsigned)block_radius || scaled_height <= 2 * (unsigned)block_radius) {
+		std::cout << "Image of " << width << " x " << height << " is too small for the block size at downsample factor "
+				  << settings.downsample << std::endl;
+		exit(1);
+	}
+	int min_disp = 0;
+	int max_disp = (int)(settings.max_disp / settings.downsample);
+	if (max_disp > 255) {
+		std::cout << "Disparity range limited to 255 pixels, the maps hold one byte per pixel" << std::endl;
+		max_disp = 255;
+	}
+	int num_candidates = max_disp + 1;
+	if (settings.calib_filename) {
+		// Only search the disparities the scene actually contains
+		Calibration calib;
+		if (!load_calibration(settings.calib_filename, calib)) {
+			std::cout << "Could not read vmin and vmax from " << settings.calib_filename << std::endl;
+			exit(1);
+		}
+		int given_max_disp = max_disp;
+		calibrated_disparity_range(calib, width, scaled_width, min_disp, max_disp);
+		if (settings.max_disp_given && given_max_disp != max_disp) {
+			std::cout << "--max-disp=" << settings.max_disp << " overrides the calibrated maximum " << max_disp
+					  << ", searching up to " << given_max_disp << std::endl;
+			max_disp = given_max_disp;
+		}
+		if (max_disp < 1 || min_disp > max_disp) {
+			std::cout << "Calibrated disparity range [" << calib.vmin << ", " << calib.vmax << "] leaves no disparity above 0 to search ("
+					  << "[" << min_disp << ", " << max_disp << "] at downsample factor " << settings.downsample << ")" << std::endl;
+			exit(1);
+		}
+		std::cout << "Calibrated disparity range [" << min_disp << ", " << max_disp << "], "
+				  << max_disp - min_disp + 1 << " of " << num_candidates << " candidates" << std::endl;
+	}
+#ifdef USE_OPENCL
+	if (settings.engine == ZNCC_OPENCL) {
+		std::cout << "Running the OpenCL pipeline..." << std::endl;
+		OpenClPipeline cl;
+		init_opencl_pipeline(cl, settings.opencl_kernel_filename);
+		DisparityMap occ_filled;
+		calc_depthmap_opencl(cl, left_img, right_img, width, height, (int)settings.downsample, min_disp, max_disp, block_radius, occ_filled);
+		release_opencl_pipeline(cl);
+
+		std::cout << "Normalizing pixel values..." << std::endl;
+		normalise_disparity_map(occ_filled, max_disp, occ_filled);
+		std::cout << "Writing output images to disk..." << std::endl;
+		encode_to_greyscale_file("depthmap.png", occ_filled);
+		std::cout << "All done!" << std::endl;
+		return 0;
+	}
+#endif
+
+	// The decoded buffers, viewed in place
+	RgbaView left_rgba = rgba_view(left_img, width, height);
+	RgbaView right_rgba = rgba_view(right_img, width, height);
 
-	// Allocate memory for resized images
-	vector<unsigned char> left_img_scaled = vector<unsigned char>();
-	vector<unsigned char> right_img_scaled = vector<unsigned char>();
+	// All planes of the frame, and of one strip with --strips, allocated once
+	FrameBuffers frame, strip;
+	ensure_frame_buffers(frame, scaled_width, scaled_height, settings.strip_height == 0);
+	if (settings.strip_height > 0) {
+		// Only the strip being matched is ever converted to greyscale
+		unsigned num_strips = (scaled_height + settings.strip_height - 1) / settings.strip_height;
+		std::cout << "Matching " << scaled_width << " x " << scaled_height << " in " << num_strips << " strips of up to "
+				  << settings.strip_height + 2 * block_radius << " rows (" << settings.strip_height << " + halo)..." << std::endl;
+		uint64_t num_candidates = 0, num_pruned = 0;
+		calc_disparity_maps_strips(settings, left_rgba, right_rgba, min_disp, max_disp, block_radius, frame, strip, num_candidates, num_pruned);
+		std::cout << "Images 1 and 2 done" << std::endl;
+		if (settings.prune) {
+			print_prune_report(num_candidates, num_pruned);
+		}
 
-	// Create resized images from original image
-	std::cout << "Resizing images..." << std::endl;
-	reduce_img_size(left_img, height, width, left_img_scaled);
-	std::cout << "Image 1 done... ";
-	reduce_img_size(right_img, height, width, right_img_scaled);
-	std::cout << "Image 2 done" << std::endl;
+		// The L2R map is free again after the cross check, so it takes the filled and normalised values
+		std::cout << "Postprocessing..." << std::endl;
+		cross_check(frame.L2R_map, frame.R2L_map, 10, frame.checked);
+		std::cout << "cross check done... ";
+		occlusion_filling(frame.checked, block_radius, frame.L2R_map);
+		std::cout << "occlusion filling done" << std::endl;
 
-	// Allocate memory for greyscale image
-	GreyscaleImage Left_img = { scaled_width, scaled_height };
-	GreyscaleImage Right_img = { scaled_width, scaled_height };
+		std::cout << "Normalizing pixel values..." << std::endl;
+		normalise_disparity_map(frame.L2R_map, max_disp, frame.L2R_map);
+		std::cout << "Writing output images to disk..." << std::endl;
+		encode_to_greyscale_file("depthmap.png", frame.L2R_map);
+		std::cout << "All done!" << std::endl;
+		return 0;
+	}
 
-	// Create greyscale images from resized images
+	// Downscale and convert both images to greyscale in one pass
 	std::cout << "Creating greyscale images..." << std::endl;
-	convert_to_greyscale(left_img_scaled, Left_img);
-	std::cout << "Image 1 done... ";
-	convert_to_greyscale(right_img_scaled, Right_img);
-	std::cout << "Image 2 done" << std::endl;
-
-	// Check that greyscale images still have the correct dimensions
-	if (Left_img.pixels.size() != scaled_width*scaled_height 
-		|| Right_img.pixels.size() != scaled_width*scaled_height) {
-		std::cout << "Greyscale image has wrong dimensions! Aborting..." << std::endl;
-	}
-
-	// Create unordered_map (pixelIndex, windowMean) of window means for both images
-	int block_radius = (BLOCK_SIZE - 1) / 2;
-	std::cout << "Mapping window averages..." << std::endl;
-	unordered_map<unsigned, float> left_img_window_avgs = calc_window_averages(Left_img, block_radius);
-	std::cout << "Image 1 done... ";
-	unordered_map<unsigned, float> right_img_window_avgs = calc_window_averages(Right_img, block_radius);
-	std::cout << "Image 2 done" << std::endl;
-
-	// Calculate disparity maps using ZNCC
-	int max_disp = MAX_DISP / 4;
-	std::cout << "Calculating disparity maps..." << std::endl;
-	vector<unsigned char> L2R_disparity_map_values = calc_disparity_map(Left_img, left_img_window_avgs, Right_img, right_img_window_avgs, 0, max_disp, block_radius);
-	std::cout << "Image 1 done... ";
-	vector<unsigned char> R2L_disparity_map_values = calc_disparity_map(Right_img, right_img_window_avgs, Left_img, left_img_window_avgs, -max_disp, 0, block_radius);
-	std::cout << "Image 2 done" << std::endl;
-
-	GreyscaleImage L_disparity_map = { scaled_width, scaled_height, L2R_disparity_map_values };
-	GreyscaleImage R_disparity_map = { scaled_width, scaled_height, R2L_disparity_map_values };
+	GreyscaleImage &Left_img = frame.left;
+	GreyscaleImage &Right_img = frame.right;
+	preprocess_images(left_rgba, right_rgba, settings.downsample, settings.downscale_filter, 0, settings.num_threads, frame.downscale, Left_img, Right_img);
+	std::cout << "Images 1 and 2 done" << std::endl;
+
+	DisparityMap &L2R_disparity_map_values = frame.L2R_map;
+	DisparityMap &R2L_disparity_map_values = frame.R2L_map;
+	Image<uint16_t> &L2R_subpixel_values = frame.subpixel_map;
+
+	if (settings.benchmark_tiles) {
+		std::cout << "Benchmarking tile sizes..." << std::endl;
+		benchmark_tiles(settings, Left_img, Right_img, min_disp, max_disp, block_radius);
+		return 0;
+	}
+
+	if (settings.engine == ZNCC_INTEGRAL || settings.engine == ZNCC_INTEGER) {
+		// Create summed-area tables for both images
+		std::cout << "Building summed-area tables..." << std::endl;
+		IntegralImage &left_img_integral = frame.left_integral, &right_img_integral = frame.right_integral;
+		calc_integral_image(Left_img, left_img_integral);
+		std::cout << "Image 1 done... ";
+		calc_integral_image(Right_img, right_img_integral);
+		std::cout << "Image 2 done" << std::endl;
+
+		// Calculate disparity maps using ZNCC
+		std::cout << "Calculating disparity maps..." << std::endl;
+		if (settings.engine == ZNCC_INTEGER) {
+			calc_disparity_map_integer(Left_img, left_img_integral, Right_img, right_img_integral, min_disp, max_disp, block_radius, settings.num_threads,
+									   frame.search, L2R_disparity_map_values);
+			std::cout << "Image 1 done... ";
+			calc_disparity_map_integer(Right_img, right_img_integral, Left_img, left_img_integral, -max_disp, -min_disp, block_radius, settings.num_threads,
+									   frame.search, R2L_disparity_map_values);
+		}
+		else {
+			calc_disparity_map_integral(Left_img, left_img_integral, Right_img, right_img_integral, min_disp, max_disp, block_radius, settings.num_threads,
+										frame.search, L2R_disparity_map_values);
+			std::cout << "Image 1 done... ";
+			calc_disparity_map_integral(Right_img, right_img_integral, Left_img, left_img_integral, -max_disp, -min_disp, block_radius, settings.num_threads,
+										frame.search, R2L_disparity_map_values);
+		}
+		std::cout << "Image 2 done" << std::endl;
+	}
+	else if (settings.engine == CENSUS_HAMMING) {
+		// Create census signatures for both images
+		std::cout << "Calculating census signatures..." << std::endl;
+		CensusImage &left_img_census = frame.left_census, &right_img_census = frame.right_census;
+		calc_census_image(Left_img, block_radius, left_img_census);
+		std::cout << "Image 1 done... ";
+		calc_census_image(Right_img, block_radius, right_img_census);
+		std::cout << "Image 2 done" << std::endl;
+
+		// Calculate disparity maps using Hamming distances
+		std::cout << "Calculating disparity maps..." << std::endl;
+		calc_disparity_map_census(left_img_census, right_img_census, min_disp, max_disp, block_radius, settings.num_threads, L2R_disparity_map_values);
+		std::cout << "Image 1 done... ";
+		calc_disparity_map_census(right_img_census, left_img_census, -max_disp, -min_disp, block_radius, settings.num_threads, R2L_disparity_map_values);
+		std::cout << "Image 2 done" << std::endl;
+	}
+	else if (settings.engine == ZNCC_DESCRIPTOR) {
+		// Create window mean and inverse deviation planes for both images
+		std::cout << "Calculating window descriptors..." << std::endl;
+		WindowDescriptors &left_img_descriptors = frame.left_descriptors, &right_img_descriptors = frame.right_descriptors;
+		calc_window_descriptors(Left_img, block_radius, settings.num_threads, frame.box, left_img_descriptors);
+		std::cout << "Image 1 done... ";
+		calc_window_descriptors(Right_img, block_radius, settings.num_threads, frame.box, right_img_descriptors);
+		std::cout << "Image 2 done" << std::endl;
+
+		// Calculate disparity maps using ZNCC
+		std::cout << "Calculating disparity maps..." << std::endl;
+		if (settings.sgm_paths > 0) {
+			CostVolume &volume = frame.cost_volume;
+			volume.resize(scaled_width, scaled_height, min_disp, max_disp, COST_INT16, COST_PIXEL_MAJOR);
+			calc_cost_volume(Left_img, left_img_descriptors, Right_img, right_img_descriptors, block_radius, settings.num_threads, frame.search, volume);
+			calc_disparity_maps_sgm(volume, block_radius, settings.sgm_paths, settings.sgm_p1, settings.sgm_p2, settings.num_threads,
+									frame.sgm, L2R_disparity_map_values, R2L_disparity_map_values);
+			std::cout << "Images 1 and 2 done" << std::endl;
+		}
+		else if (settings.subpixel) {
+			calc_disparity_map_subpixel(Left_img, left_img_descriptors, Right_img, right_img_descriptors, min_disp, max_disp, block_radius,
+										settings.num_threads, frame.search, L2R_disparity_map_values, L2R_subpixel_values);
+			std::cout << "Image 1 done... ";
+			calc_disparity_map_descriptor(Right_img, right_img_descriptors, Left_img, left_img_descriptors, -max_disp, -min_disp, block_radius, settings.num_threads,
+										  settings.tile_width, settings.tile_height, R2L_disparity_map_values);
+			std::cout << "Image 2 done" << std::endl;
+		}
+		else if (settings.pyramid_levels > 0) {
+			calc_disparity_maps_pyramid(Left_img, left_img_descriptors, Right_img, right_img_descriptors, min_disp, max_disp, block_radius,
+										settings.pyramid_levels, settings.pyramid_band, settings.num_threads,
+										frame.pyramid, L2R_disparity_map_values, R2L_disparity_map_values);
+			std::cout << "Images 1 and 2 done" << std::endl;
+		}
+		else if (settings.store_cost_volume) {
+			CostVolume &volume = frame.cost_volume;
+			volume.resize(scaled_width, scaled_height, min_disp, max_disp, settings.cost_storage, settings.cost_layout);
+			std::cout << "(cost volume " << scaled_width << " x " << scaled_height << " x " << max_disp - min_disp + 1 << ", "
+					  << volume.size_in_bytes() / (1024 * 1024) << " MB) ";
+			calc_cost_volume(Left_img, left_img_descriptors, Right_img, right_img_descriptors, block_radius, settings.num_threads, frame.search, volume);
+			extract_disparity_maps(volume, block_radius, settings.num_threads, L2R_disparity_map_values, R2L_disparity_map_values);
+			std::cout << "Images 1 and 2 done" << std::endl;
+		}
+		else if (settings.shared_cost_volume) {
+			calc_disparity_maps_shared(Left_img, left_img_descriptors, Right_img, right_img_descriptors, min_disp, max_disp, block_radius,
+									   settings.num_threads, frame.search, L2R_disparity_map_values, R2L_disparity_map_values);
+			std::cout << "Images 1 and 2 done" << std::endl;
+		}
+		else if (settings.prune) {
+			uint64_t num_candidates = 0, num_pruned = 0;
+			calc_disparity_map_pruned(Left_img, left_img_descriptors, Right_img, right_img_descriptors, min_disp, max_disp, block_radius, settings.num_threads,
+									  settings.tile_width, settings.tile_height, num_candidates, num_pruned, L2R_disparity_map_values);
+			std::cout << "Image 1 done... ";
+			calc_disparity_map_pruned(Right_img, right_img_descriptors, Left_img, left_img_descriptors, -max_disp, -min_disp, block_radius, settings.num_threads,
+									  settings.tile_width, settings.tile_height, num_candidates, num_pruned, R2L_disparity_map_values);
+			std::cout << "Image 2 done" << std::endl;
+			print_prune_report(num_candidates, num_pruned);
+		}
+		else {
+			calc_disparity_map_descriptor(Left_img, left_img_descriptors, Right_img, right_img_descriptors, min_disp, max_disp, block_radius, settings.num_threads,
+										  settings.tile_width, settings.tile_height, L2R_disparity_map_values);
+			std::cout << "Image 1 done... ";
+			calc_disparity_map_descriptor(Right_img, right_img_descriptors, Left_img, left_img_descriptors, -max_disp, -min_disp, block_radius, settings.num_threads,
+										  settings.tile_width, settings.tile_height, R2L_disparity_map_values);
+			std::cout << "Image 2 done" << std::endl;
+		}
+	}
+	else {
+		// Create window mean planes for both images
+		std::cout << "Mapping window averages..." << std::endl;
+		WindowMeans &left_img_window_avgs = frame.left_means;
+		WindowMeans &right_img_window_avgs = frame.right_means;
+		calc_window_averages(Left_img, block_radius, settings.num_threads, frame.box, left_img_window_avgs);
+		std::cout << "Image 1 done... ";
+		calc_window_averages(Right_img, block_radius, settings.num_threads, frame.box, right_img_window_avgs);
+		std::cout << "Image 2 done" << std::endl;
+
+		// Calculate disparity maps using ZNCC
+		std::cout << "Calculating disparity maps..." << std::endl;
+		if (settings.engine == ZNCC_SIMD) {
+			calc_disparity_map_simd(Left_img, left_img_window_avgs, Right_img, right_img_window_avgs, min_disp, max_disp, block_radius, settings.num_threads, settings.tile_width, settings.tile_height, L2R_disparity_map_values);
+			std::cout << "Image 1 done... ";
+			calc_disparity_map_simd(Right_img, right_img_window_avgs, Left_img, left_img_window_avgs, -max_disp, -min_disp, block_radius, settings.num_threads, settings.tile_width, settings.tile_height, R2L_disparity_map_values);
+		}
+		else {
+			calc_disparity_map(Left_img, left_img_window_avgs, Right_img, right_img_window_avgs, min_disp, max_disp, block_radius, settings.num_threads, settings.tile_width, settings.tile_height, L2R_disparity_map_values);
+			std::cout << "Image 1 done... ";
+			calc_disparity_map(Right_img, right_img_window_avgs, Left_img, left_img_window_avgs, -max_disp, -min_disp, block_radius, settings.num_threads, settings.tile_width, settings.tile_height, R2L_disparity_map_values);
+		}
+		std::cout << "Image 2 done" << std::endl;
+	}
 
 	// Post-process images
 	std::cout << "Postprocessing..." << std::endl;
-	GreyscaleImage x_checked = cross_check(L_disparity_map, R_disparity_map, 10);
+	DisparityMap &x_checked = frame.checked;
+	cross_check(frame.L2R_map, frame.R2L_map, 10, x_checked);
 	std::cout << "cross check done... ";
-	GreyscaleImage occ_filled = occlusion_filling(x_checked);
+	DisparityMap &occ_filled = frame.filled;
+	occlusion_filling(x_checked, block_radius, occ_filled);
 	std::cout << "occlusion filling done" << std::endl;
 
 	std::cout << "Normalizing pixel values..." << std::endl;
-	GreyscaleImage normalized = normalise_disparity_map(occ_filled, max_disp);
+	DisparityMap &normalized = frame.normalised;
+	normalise_disparity_map(occ_filled, max_disp, normalized);
 	
 	/*
 	// FOR DEBUGGING
-	// Encode the resized images
-	const char *resized_filename_1 = "resized1.png";
-	const char *resized_filename_2 = "resized2.png";
-	encode_to_32_file(resized_filename_1, left_img_scaled, scaled_width, scaled_height);
-	encode_to_32_file(resized_filename_2, right_img_scaled, scaled_width, scaled_height);
+	// Encode the greyscale images
+	const char *greyscale_filename_1 = "greyscale1.png";
+	const char *greyscale_filename_2 = "greyscale2.png";
+	encode_to_greyscale_file(greyscale_filename_1, Left_img);
+	encode_to_greyscale_file(greyscale_filename_2, Right_img);
 	*/
 	
 	std::cout << "Writing output images to disk..." << std::endl;
 	const char *output_filename = "depthmap.png";
-	encode_to_greyscale_file(output_filename, normalized.pixels, scaled_width, scaled_height);
+	encode_to_greyscale_file(output_filename, normalized);
+
+	if (settings.subpixel) {
+		// Sub-pixel disparities of the pixels that passed the cross check, 0 elsewhere
+		for (unsigned y = 0; y < L2R_subpixel_values.height; y++) {
+			for (unsigned x = 0; x < L2R_subpixel_values.width; x++) {
+				if (!x_checked.row(y)[x]) {
+					L2R_subpixel_values.row(y)[x] = 0;
+				}
+			}
+		}
+		const char *subpixel_filename = "depthmap16.png";
+		encode_to_greyscale_16_file(subpixel_filename, L2R_subpixel_values);
+	}
 
 	std::cout << "All done!" << std::endl;
 	return 0;
@@ -0,0 +1,156 @@
+/*
+	OpenCL kernels of the depthmap pipeline, used by --engine=opencl.
+	Each kernel repeats the arithmetic of its C++ counterpart in depthmap.cpp, so a
+	runtime with double support produces the same maps as the direct engine.
+	All kernels run one work-item per output pixel over a width x height range.
+*/
+#pragma OPENCL FP_CONTRACT OFF
+
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double accum_t;
+#else
+typedef float accum_t; // without doubles the ZNCC denominators round slightly differently
+#endif
+
+#define NO_MEAN (-1.0f)
+
+#define GREY_RED 6966
+#define GREY_GREEN 23436
+#define GREY_BLUE 2366
+#define GREY_ROUNDING 6
+
+// Every downsample_factor-th pixel of the RGBA input, converted in fixed point like downscale_greyscale_row
+__kernel void greyscale(__global const uchar *rgba, int input_width, int downsample_factor, __global uchar *grey)
+{
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int width = get_global_size(0);
+	size_t byte = 4 * ((size_t)y * downsample_factor * input_width + (size_t)x * downsample_factor);
+	uint value = GREY_RED * rgba[byte] + GREY_GREEN * rgba[byte + 1] + GREY_BLUE * rgba[byte + 2] + GREY_ROUNDING;
+	grey[y*width + x] = (uchar)(value >> 15);
+}
+
+// Window mean of every pixel, NO_MEAN where the window leaves the image (calc_window_averages)
+__kernel void window_means(__global const uchar *image, int block_radius, __global float *means)
+{
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int width = get_global_size(0);
+	int height = get_global_size(1);
+	if (x - block_radius < 0 || x + block_radius >= width || y - block_radius < 0 || y + block_radius >= height) {
+		means[y*width + x] = NO_MEAN;
+		return;
+	}
+	uint sum = 0;
+	for (int wy = y - block_radius; wy <= y + block_radius; wy++) {
+		for (int wx = x - block_radius; wx <= x + block_radius; wx++) {
+			sum += image[wy*width + wx];
+		}
+	}
+	means[y*width + x] = (float)sum / (float)((2 * block_radius + 1) * (2 * block_radius + 1));
+}
+
+/*
+	ZNCC disparity search of one source pixel (calc_disparity_rows). Candidates run from
+	min_disp upwards until the reference window leaves the image, the first best score wins
+	and the result is stored as abs(disparity).
+*/
+__kernel void zncc_disparity(__global const uchar *src, __global const float *src_means,
+							 __global const uchar *ref, __global const float *ref_means,
+							 int min_disp, int max_disp, int block_radius, __global uchar *disparity_map)
+{
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int width = get_global_size(0);
+	int height = get_global_size(1);
+	if (x - block_radius < 0 || x + block_radius >= width || y - block_radius < 0 || y + block_radius >= height) {
+		disparity_map[y*width + x] = 0;
+		return;
+	}
+
+	float src_mean = src_means[y*width + x];
+	float src_denominator = 0;
+	for (int wy = y - block_radius; wy <= y + block_radius; wy++) {
+		for (int wx = x - block_radius; wx <= x + block_radius; wx++) {
+			float src_diff = src[wy*width + wx] - src_mean;
+			src_denominator = (float)(src_denominator + (accum_t)src_diff * src_diff);
+		}
+	}
+	accum_t src_den_sqrt = sqrt((accum_t)src_denominator);
+
+	float best_zncc = 0;
+	int best_disp = 0;
+	for (int disparity = min_disp; disparity <= max_disp; disparity++) {
+		int offset = x - disparity;
+		if (offset - block_radius < 0 || offset + block_radius >= width) {
+			break;
+		}
+		float ref_mean = ref_means[y*width + offset];
+		float numerator = 0;
+		float ref_denominator = 0;
+		for (int wy = -block_radius; wy <= block_radius; wy++) {
+			for (int wx = -block_radius; wx <= block_radius; wx++) {
+				float src_diff = src[(y + wy)*width + x + wx] - src_mean;
+				float ref_diff = ref[(y + wy)*width + offset + wx] - ref_mean;
+				numerator += src_diff * ref_diff;
+				ref_denominator = (float)(ref_denominator + (accum_t)ref_diff * ref_diff);
+			}
+		}
+		float zncc = (float)(numerator / (src_den_sqrt * sqrt((accum_t)ref_denominator)));
+		if (zncc > best_zncc) {
+			best_zncc = zncc;
+			best_disp = disparity;
+		}
+	}
+	disparity_map[y*width + x] = abs(best_disp);
+}
+
+// Keeps left disparities that agree with the right map within threshold (cross_check)
+__kernel void cross_check(__global const uchar *left, __global const uchar *right, int threshold, __global uchar *checked)
+{
+	int i = get_global_id(1) * get_global_size(0) + get_global_id(0);
+	int disparity = left[i];
+	int match = i - disparity;
+	checked[i] = (match < 0 || abs(disparity - (int)right[match]) > threshold) ? 0 : disparity;
+}
+
+// Pixel value, 0 outside the image (GreyscaleImage::get_pixel with its unsigned wrap-around)
+inline uchar get_pixel(__global const uchar *image, int width, int height, int x, int y)
+{
+	return (x < 0 || y < 0 || x >= width || y >= height) ? 0 : image[y*width + x];
+}
+
+/*
+	Zero pixels take the nearest non-zero value found on square rings of growing radius,
+	scanned in the order of get_nearest_nonzero_pixel. Pixels within block_radius of any
+	border are cleared, like in occlusion_filling.
+*/
+__kernel void occlusion_fill(__global const uchar *image, int block_radius, __global uchar *filled)
+{
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int width = get_global_size(0);
+	int height = get_global_size(1);
+	if (x < block_radius || x + block_radius >= width || y < block_radius || y + block_radius >= height) {
+		filled[y*width + x] = 0;
+		return;
+	}
+	uchar value = image[y*width + x];
+	int max_radius = width > height ? width : height;
+	for (int radius = 1; !value && radius <= max_radius; radius++) {
+		for (int dy = radius; dy > -radius && !value; dy--) {
+			value = get_pixel(image, width, height, x + radius, y + dy);
+		}
+		for (int dx = radius; dx > -radius && !value; dx--) {
+			value = get_pixel(image, width, height, x + dx, y - radius);
+		}
+		for (int dy = -radius; dy < radius && !value; dy++) {
+			value = get_pixel(image, width, height, x - radius, y + dy);
+		}
+		for (int dx = -radius; dx < radius && !value; dx++) {
+			value = get_pixel(image, width, height, x + dx, y + radius);
+		}
+	}
+	filled[y*width + x] = value;
+}